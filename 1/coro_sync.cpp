@@ -0,0 +1,260 @@
+#include "coro_sync.h"
+
+#include <assert.h>
+
+/** A suspended coroutine. Lives on its stack. */
+struct coro_sync_waiter {
+	/** Coroutine to wake up. */
+	struct coro *coro;
+	/**
+	 * The waiter got what it waited for. A coroutine can be
+	 * woken up spuriously, so it waits until this is set.
+	 */
+	bool is_done;
+	/** Link in the list of the waiters of a primitive. */
+	struct rlist link;
+};
+
+/** Put the current coroutine to the end of the list. */
+static inline void
+coro_sync_waiter_add(struct coro_sync_waiter *w, struct rlist *waiters)
+{
+	w->coro = coro_this();
+	w->is_done = false;
+	rlist_add_tail_entry(waiters, w, link);
+}
+
+/** Wait until woken up via coro_sync_wake_first(). */
+static inline void
+coro_sync_waiter_wait(struct coro_sync_waiter *w)
+{
+	while (!__atomic_load_n(&w->is_done, __ATOMIC_ACQUIRE))
+		coro_suspend();
+}
+
+/** Wait in the list, releasing the lock meanwhile. */
+static void
+coro_sync_wait(struct rlist *waiters, int *lock)
+{
+	struct coro_sync_waiter w;
+	coro_sync_waiter_add(&w, waiters);
+	coro_spin_unlock(lock);
+	coro_sync_waiter_wait(&w);
+}
+
+/** Wake up the first waiter of the list. Called under the lock. */
+static void
+coro_sync_wake_first(struct rlist *waiters)
+{
+	struct coro_sync_waiter *w = rlist_shift_entry(waiters,
+		struct coro_sync_waiter, link);
+	struct coro *c = w->coro;
+	/* The waiter can be gone right after that. */
+	__atomic_store_n(&w->is_done, true, __ATOMIC_RELEASE);
+	coro_wakeup(c);
+}
+
+//////////////////////////////////////////////////////////////////
+
+void
+coro_mutex_create(struct coro_mutex *mutex)
+{
+	mutex->lock = 0;
+	mutex->is_locked = false;
+	rlist_create(&mutex->waiters);
+}
+
+void
+coro_mutex_destroy(struct coro_mutex *mutex)
+{
+	assert(!mutex->is_locked);
+	assert(rlist_empty(&mutex->waiters));
+	(void)mutex;
+}
+
+void
+coro_mutex_lock(struct coro_mutex *mutex)
+{
+	coro_spin_lock(&mutex->lock);
+	if (!mutex->is_locked) {
+		mutex->is_locked = true;
+		coro_spin_unlock(&mutex->lock);
+		return;
+	}
+	/* The unlocker leaves the mutex locked for us. */
+	coro_sync_wait(&mutex->waiters, &mutex->lock);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *mutex)
+{
+	coro_spin_lock(&mutex->lock);
+	bool is_ok = !mutex->is_locked;
+	mutex->is_locked = true;
+	coro_spin_unlock(&mutex->lock);
+	return is_ok;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *mutex)
+{
+	coro_spin_lock(&mutex->lock);
+	assert(mutex->is_locked);
+	if (rlist_empty(&mutex->waiters))
+		mutex->is_locked = false;
+	else
+		coro_sync_wake_first(&mutex->waiters);
+	coro_spin_unlock(&mutex->lock);
+}
+
+//////////////////////////////////////////////////////////////////
+
+void
+coro_cond_create(struct coro_cond *cond)
+{
+	cond->lock = 0;
+	rlist_create(&cond->waiters);
+}
+
+void
+coro_cond_destroy(struct coro_cond *cond)
+{
+	assert(rlist_empty(&cond->waiters));
+	(void)cond;
+}
+
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex)
+{
+	/*
+	 * The mutex is unlocked only after the waiter is in the
+	 * list, so a signal sent right after the unlock is not lost.
+	 */
+	struct coro_sync_waiter w;
+	coro_spin_lock(&cond->lock);
+	coro_sync_waiter_add(&w, &cond->waiters);
+	coro_spin_unlock(&cond->lock);
+	coro_mutex_unlock(mutex);
+	coro_sync_waiter_wait(&w);
+	coro_mutex_lock(mutex);
+}
+
+void
+coro_cond_signal(struct coro_cond *cond)
+{
+	coro_spin_lock(&cond->lock);
+	if (!rlist_empty(&cond->waiters))
+		coro_sync_wake_first(&cond->waiters);
+	coro_spin_unlock(&cond->lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *cond)
+{
+	coro_spin_lock(&cond->lock);
+	while (!rlist_empty(&cond->waiters))
+		coro_sync_wake_first(&cond->waiters);
+	coro_spin_unlock(&cond->lock);
+}
+
+//////////////////////////////////////////////////////////////////
+
+void
+coro_sem_create(struct coro_sem *sem, long count)
+{
+	assert(count >= 0);
+	sem->lock = 0;
+	sem->count = count;
+	rlist_create(&sem->waiters);
+}
+
+void
+coro_sem_destroy(struct coro_sem *sem)
+{
+	assert(rlist_empty(&sem->waiters));
+	(void)sem;
+}
+
+void
+coro_sem_wait(struct coro_sem *sem)
+{
+	coro_spin_lock(&sem->lock);
+	if (sem->count > 0) {
+		/* Can't be waiters when there are units. */
+		assert(rlist_empty(&sem->waiters));
+		--sem->count;
+		coro_spin_unlock(&sem->lock);
+		return;
+	}
+	/* The poster hands the unit over to us. */
+	coro_sync_wait(&sem->waiters, &sem->lock);
+}
+
+bool
+coro_sem_trywait(struct coro_sem *sem)
+{
+	coro_spin_lock(&sem->lock);
+	bool is_ok = sem->count > 0;
+	if (is_ok)
+		--sem->count;
+	coro_spin_unlock(&sem->lock);
+	return is_ok;
+}
+
+void
+coro_sem_post(struct coro_sem *sem)
+{
+	coro_spin_lock(&sem->lock);
+	if (rlist_empty(&sem->waiters))
+		++sem->count;
+	else
+		coro_sync_wake_first(&sem->waiters);
+	coro_spin_unlock(&sem->lock);
+}
+
+//////////////////////////////////////////////////////////////////
+
+void
+coro_waitgroup_create(struct coro_waitgroup *wg)
+{
+	wg->lock = 0;
+	wg->count = 0;
+	rlist_create(&wg->waiters);
+}
+
+void
+coro_waitgroup_destroy(struct coro_waitgroup *wg)
+{
+	assert(rlist_empty(&wg->waiters));
+	(void)wg;
+}
+
+void
+coro_waitgroup_add(struct coro_waitgroup *wg, long delta)
+{
+	coro_spin_lock(&wg->lock);
+	wg->count += delta;
+	assert(wg->count >= 0);
+	if (wg->count == 0) {
+		while (!rlist_empty(&wg->waiters))
+			coro_sync_wake_first(&wg->waiters);
+	}
+	coro_spin_unlock(&wg->lock);
+}
+
+void
+coro_waitgroup_done(struct coro_waitgroup *wg)
+{
+	coro_waitgroup_add(wg, -1);
+}
+
+void
+coro_waitgroup_wait(struct coro_waitgroup *wg)
+{
+	coro_spin_lock(&wg->lock);
+	if (wg->count == 0) {
+		coro_spin_unlock(&wg->lock);
+		return;
+	}
+	coro_sync_wait(&wg->waiters, &wg->lock);
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "libcoro.h"
+#include "rlist.h"
+
+/*
+ * Synchronization primitives for the coroutines. The waiting
+ * coroutines are suspended, not the threads. The primitives are
+ * intrusive and don't allocate - they are embedded into the user's
+ * objects, and each waiter lives on the stack of its coroutine.
+ *
+ * The waiters are served in FIFO order with a direct handoff: a
+ * released mutex or a posted semaphore unit goes straight to the
+ * first waiter, so a newcomer can't overtake it.
+ *
+ * The primitives can be used by the coroutines of a worker pool.
+ * Their state is protected by a spinlock, which is never held
+ * across a suspension.
+ */
+
+/**
+ * Spinlock protecting a primitive. It is held only for a few
+ * instructions and never across a suspension, so spinning is
+ * cheaper than anything else.
+ */
+static inline void
+coro_spin_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0)
+			;
+	}
+}
+
+static inline void
+coro_spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+struct coro_mutex {
+	/** Protects the fields below. */
+	int lock;
+	/** The mutex is owned by a coroutine. */
+	bool is_locked;
+	/** Coroutines waiting for the mutex. */
+	struct rlist waiters;
+};
+
+void
+coro_mutex_create(struct coro_mutex *mutex);
+
+/** Destroy a mutex. It must be unlocked and have no waiters. */
+void
+coro_mutex_destroy(struct coro_mutex *mutex);
+
+/** Lock the mutex, waiting for it if necessary. */
+void
+coro_mutex_lock(struct coro_mutex *mutex);
+
+/** Lock the mutex if it is free. Returns true on success. */
+bool
+coro_mutex_trylock(struct coro_mutex *mutex);
+
+/** Unlock the mutex, handing it over to the first waiter if any. */
+void
+coro_mutex_unlock(struct coro_mutex *mutex);
+
+struct coro_cond {
+	/** Protects the fields below. */
+	int lock;
+	/** Coroutines waiting for a signal. */
+	struct rlist waiters;
+};
+
+void
+coro_cond_create(struct coro_cond *cond);
+
+/** Destroy a condition variable. It must have no waiters. */
+void
+coro_cond_destroy(struct coro_cond *cond);
+
+/**
+ * Unlock the mutex, wait for a signal, and lock the mutex again.
+ * The awaited condition should be checked in a loop, it might be
+ * changed by someone else before the mutex is locked again.
+ */
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex);
+
+/** Wake up the first waiter, if any. */
+void
+coro_cond_signal(struct coro_cond *cond);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *cond);
+
+struct coro_sem {
+	/** Protects the fields below. */
+	int lock;
+	/** Available units. */
+	long count;
+	/** Coroutines waiting for a unit. */
+	struct rlist waiters;
+};
+
+void
+coro_sem_create(struct coro_sem *sem, long count);
+
+/** Destroy a semaphore. It must have no waiters. */
+void
+coro_sem_destroy(struct coro_sem *sem);
+
+/** Take a unit, waiting for it if necessary. */
+void
+coro_sem_wait(struct coro_sem *sem);
+
+/** Take a unit if there is one. Returns true on success. */
+bool
+coro_sem_trywait(struct coro_sem *sem);
+
+/** Return a unit, handing it over to the first waiter if any. */
+void
+coro_sem_post(struct coro_sem *sem);
+
+/**
+ * Wait group is a counter of unfinished jobs, and the coroutines
+ * can wait for it to become zero.
+ */
+struct coro_waitgroup {
+	/** Protects the fields below. */
+	int lock;
+	/** Unfinished jobs. */
+	long count;
+	/** Coroutines waiting for the count to become zero. */
+	struct rlist waiters;
+};
+
+void
+coro_waitgroup_create(struct coro_waitgroup *wg);
+
+/** Destroy a wait group. It must have no waiters. */
+void
+coro_waitgroup_destroy(struct coro_waitgroup *wg);
+
+/**
+ * Add @a delta to the counter. It must not become negative. When
+ * it becomes zero, all the waiters are woken up.
+ */
+void
+coro_waitgroup_add(struct coro_waitgroup *wg, long delta);
+
+/** Same as adding -1. */
+void
+coro_waitgroup_done(struct coro_waitgroup *wg);
+
+/** Wait until the counter is zero. */
+void
+coro_waitgroup_wait(struct coro_waitgroup *wg);
@@ -1,15 +1,17 @@
 #include "corobus.h"
 
+#include "coro_sync.h"
 #include "libcoro.h"
 #include "rlist.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#include <queue>
 #include <vector>
-#include <optional>
 
 
 /**
@@ -19,6 +21,16 @@
 struct wakeup_entry {
 	struct rlist base;
 	struct coro *coro;
+	/**
+	 * Messages of a waiting sender, or a buffer of a waiting
+	 * receiver. A peer can move the messages right from or to
+	 * there, and the waiter wakes up with the job done.
+	 */
+	char *data;
+	/** Number of the messages or the buffer capacity left. */
+	unsigned count;
+	/** How many messages peers have moved. */
+	unsigned result;
 };
 
 /** A queue of suspended coros waiting to be woken up. */
@@ -26,535 +38,1416 @@ struct wakeup_queue {
 	struct rlist coros;
 };
 
-#if 0 /* Uncomment this if want to use */
-
-/** Suspend the current coroutine until it is woken up. */
 static void
-wakeup_queue_suspend_this(struct wakeup_queue *queue)
+wakeup_queue_create(struct wakeup_queue *queue)
+{
+	rlist_create(&queue->coros);
+}
+
+static inline bool
+wakeup_queue_is_empty(const struct wakeup_queue *queue)
+{
+	return rlist_empty(&queue->coros);
+}
+
+/**
+ * Suspend the current coroutine until it is woken up. The entry is
+ * on the stack, so waiting doesn't allocate. A waker unlinks the
+ * entry itself, so the queue can be gone by the time the coroutine
+ * runs. If it is woken up by someone else, the entry is still in
+ * the queue and is unlinked here - no stale entries are left.
+ * Returns how many messages were moved by peers. 0 means the
+ * waiter has to retry itself.
+ */
+static unsigned
+wakeup_queue_suspend_this(struct wakeup_queue *queue, char *data,
+	unsigned count)
 {
 	struct wakeup_entry entry;
 	entry.coro = coro_this();
+	entry.data = data;
+	entry.count = count;
+	entry.result = 0;
 	rlist_add_tail_entry(&queue->coros, &entry, base);
 	coro_suspend();
 	rlist_del_entry(&entry, base);
+	return entry.result;
+}
+
+static inline struct wakeup_entry *
+wakeup_queue_first(struct wakeup_queue *queue)
+{
+	if (rlist_empty(&queue->coros))
+		return NULL;
+	return rlist_first_entry(&queue->coros, struct wakeup_entry, base);
+}
+
+/** Unlink the entry and wake its coroutine up. */
+static void
+wakeup_entry_wakeup(struct wakeup_entry *entry)
+{
+	rlist_del_entry(entry, base);
+	coro_wakeup(entry->coro);
+}
+
+/**
+ * Account the messages moved from or to the waiter by a peer, and
+ * wake it up. Until it runs, the waiter stays first in the queue
+ * and gets more messages or space - the same as if it was woken up
+ * to retry. It is unlinked only when nothing is left to move.
+ */
+static void
+wakeup_entry_advance(struct wakeup_entry *entry, size_t count,
+	size_t elem_size)
+{
+	assert(count > 0 && count <= entry->count);
+	entry->data += count * elem_size;
+	entry->count -= count;
+	entry->result += count;
+	if (entry->count == 0)
+		rlist_del_entry(entry, base);
+	coro_wakeup(entry->coro);
 }
 
 /** Wakeup the first coroutine in the queue. */
 static void
 wakeup_queue_wakeup_first(struct wakeup_queue *queue)
 {
-	if (rlist_empty(&queue->coros))
-		return;
-	struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
-		struct wakeup_entry, base);
-	coro_wakeup(entry->coro);
+	struct wakeup_entry *entry = wakeup_queue_first(queue);
+	if (entry != NULL)
+		wakeup_entry_wakeup(entry);
 }
 
-#endif
+/** Wakeup all the coroutines in the queue. Returns how many. */
+static size_t
+wakeup_queue_wakeup_all(struct wakeup_queue *queue)
+{
+	size_t count = 0;
+	for (; !rlist_empty(&queue->coros); ++count)
+		wakeup_queue_wakeup_first(queue);
+	return count;
+}
+
+/**
+ * A channel a broadcast is going to send to. While the channel is
+ * full, the broadcast waits in its send queue with no data, and
+ * the channel reserves a slot for it when has space.
+ */
+struct coro_bus_broadcast_target {
+	/** Waiter in the send queue. Must be first. */
+	struct wakeup_entry entry;
+	/** Descriptor and generation, to see if the channel is gone. */
+	int channel;
+	unsigned generation;
+	/** Waits for space in the channel. */
+	bool is_waiting;
+	/** A slot of the channel is reserved for the message. */
+	bool is_reserved;
+	/**
+	 * Channels the broadcast still waits for, shared by all its
+	 * targets. It is woken up only when this becomes zero.
+	 */
+	unsigned *blocked;
+};
 
 struct coro_bus_channel {
-	/** Channel max capacity. */
+	/**
+	 * Channel max capacity. 0 means the messages are only
+	 * handed from a sender to a receiver directly.
+	 */
 	size_t size_limit;
 	/** Coroutines waiting until the channel is not full. */
-	std::queue<coro*> send_queue;
+	struct wakeup_queue send_queue;
 	/** Coroutines waiting until the channel is not empty. */
-	std::queue<coro*> recv_queue;
-	/** Message queue. */
-	/* std::vector/queue/deque/list/...<unsigned> data; */
-	std::queue<unsigned> data;
+	struct wakeup_queue recv_queue;
+	/**
+	 * Selects waiting for the channel. They are woken up on any
+	 * change and check what they need themselves.
+	 */
+	struct wakeup_queue select_queue;
+	/** Size of one message in bytes. */
+	size_t elem_size;
+	/**
+	 * Messages, in a ring buffer allocated once on open. Its
+	 * size is a power of 2 not less than the size limit, so a
+	 * position is wrapped with a mask.
+	 */
+	char *ring;
+	/** Ring size - 1. */
+	size_t ring_mask;
+	/** Position of the oldest message. */
+	size_t head;
+	/** Number of messages in the ring. */
+	size_t count;
+	/** Free slots reserved for the waiting broadcasts. */
+	size_t reserved;
+	/** Counters, the depth is filled on request. */
+	struct coro_bus_channel_stats stats;
+	/**
+	 * The messages are references to the shared messages, and the
+	 * channel owns them.
+	 */
+	bool is_shared;
+	/** Descriptor, and its generation at open. */
+	int descriptor;
+	unsigned generation;
+	/** Position in the list of the open channels of the bus. */
+	size_t live_index;
+};
+
+/** A slot of the descriptor table. */
+struct coro_bus_slot {
+	/**
+	 * The channel, NULL if the slot is free. The channels don't
+	 * move, the waiters are linked into them.
+	 */
+	struct coro_bus_channel *chan;
+	/**
+	 * Bumped on each close. A descriptor is reused right away, so
+	 * a waiter compares the generation of the channel with the
+	 * one it saw before suspension, not to end up in a new channel.
+	 */
+	unsigned generation;
+	/** Next free slot, -1 if it is the last one. */
+	int next_free;
 };
 
 struct coro_bus {
-	std::vector<std::optional<coro_bus_channel>> channels;
-	int channel_count;
+	/** Descriptor table, a descriptor is an index in it. */
+	std::vector<struct coro_bus_slot> slots;
+	/** The last freed slot, -1 if there are no free ones. */
+	int free_head;
+	/** Open channels, densely, for broadcast. */
+	std::vector<struct coro_bus_channel *> live;
 };
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+/**
+ * The error is coroutine-local, so a coroutine's error isn't
+ * overwritten by the others while it is suspended.
+ */
+static pthread_once_t coro_bus_errno_once = PTHREAD_ONCE_INIT;
+static coro_key_t coro_bus_errno_key;
+
+static void
+coro_bus_errno_key_create(void)
+{
+	if (coro_key_create(&coro_bus_errno_key, NULL) != 0)
+		abort();
+}
 
 enum coro_bus_error_code
 coro_bus_errno(void)
 {
-	return global_error;
+	pthread_once(&coro_bus_errno_once, coro_bus_errno_key_create);
+	return (enum coro_bus_error_code)(intptr_t)
+		coro_getspecific(coro_bus_errno_key);
 }
 
 void
 coro_bus_errno_set(enum coro_bus_error_code err)
 {
-	global_error = err;
+	pthread_once(&coro_bus_errno_once, coro_bus_errno_key_create);
+	coro_setspecific(coro_bus_errno_key, (void *)(intptr_t)err);
 }
 
-struct coro_bus *
-coro_bus_new(void)
+static uint64_t
+coro_bus_clock_ns(void)
 {
-	coro_bus *new_coro_bus = new coro_bus{.channels=std::vector<std::optional<coro_bus_channel>>(), .channel_count=0};
-	return new_coro_bus;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-void
-coro_bus_delete(struct coro_bus *bus)
+////////////////////////////////////////////////////////////////////////////////
+
+static struct coro_bus_channel *
+coro_bus_channel_new(size_t size_limit, size_t elem_size)
 {
-	for (auto i = 0; i < bus->channel_count; ++i) {
-		coro_bus_channel_close(bus, i);
-	}
-	
-	bus->channel_count = 0;
+	struct coro_bus_channel *chan = new coro_bus_channel();
+	size_t ring_size = 1;
+	while (ring_size < size_limit)
+		ring_size <<= 1;
+	chan->size_limit = size_limit;
+	wakeup_queue_create(&chan->send_queue);
+	wakeup_queue_create(&chan->recv_queue);
+	wakeup_queue_create(&chan->select_queue);
+	chan->elem_size = elem_size;
+	chan->ring = new char[ring_size * elem_size];
+	chan->ring_mask = ring_size - 1;
+	chan->head = 0;
+	chan->count = 0;
+	chan->reserved = 0;
+	chan->is_shared = false;
+	memset(&chan->stats, 0, sizeof(chan->stats));
+	return chan;
+}
 
-	delete bus;
+static void
+coro_bus_channel_delete(struct coro_bus_channel *chan)
+{
+	assert(wakeup_queue_is_empty(&chan->send_queue));
+	assert(wakeup_queue_is_empty(&chan->recv_queue));
+	assert(wakeup_queue_is_empty(&chan->select_queue));
+	delete[] chan->ring;
+	delete chan;
 }
 
-int
-coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+static inline bool
+coro_bus_channel_is_full(const struct coro_bus_channel *chan)
 {
-	if (bus->channel_count > 0) {
-		for (auto i = 0; i < bus->channel_count; ++i) {
-			if (!bus->channels.at(i).has_value()) {
-				bus->channels[i] = std::make_optional<coro_bus_channel>(coro_bus_channel{
-					.size_limit = size_limit,
-					.send_queue = std::queue<coro*>(),
-					.recv_queue = std::queue<coro*>(),
-					.data = std::queue<unsigned>()
-				});
-
-				return i;
-			}
-		}
-	}
+	return chan->count + chan->reserved >= chan->size_limit;
+}
 
-	bus->channels.emplace_back(std::in_place, size_limit, std::queue<coro*>(), std::queue<coro*>(), std::queue<unsigned>());
-	++bus->channel_count;
-	
-	return bus->channel_count - 1;
+/**
+ * A message can be sent right now. Even the ones handed to the
+ * waiting receivers directly are counted against the free space,
+ * which can be reserved by a broadcast, so only a zero-capacity
+ * channel depends on the receivers.
+ */
+static inline bool
+coro_bus_channel_can_send(const struct coro_bus_channel *chan)
+{
+	if (chan->size_limit == 0)
+		return !wakeup_queue_is_empty(&chan->recv_queue);
+	return !coro_bus_channel_is_full(chan);
 }
 
-void
-coro_bus_channel_close(struct coro_bus *bus, int channel)
+/**
+ * A message can be received right now - either from the ring, or
+ * from a waiting sender.
+ */
+static inline bool
+coro_bus_channel_can_recv(struct coro_bus_channel *chan)
 {
-	if ((channel >= bus->channel_count) || (!bus->channels.at(channel).has_value())) {
-		return;
-	}
+	if (chan->count > 0)
+		return true;
+	struct wakeup_entry *sender = wakeup_queue_first(&chan->send_queue);
+	return sender != NULL && sender->count > 0;
+}
 
-	auto &chan = bus->channels.at(channel);
+/** Let the selects of the channel check it again. */
+static inline void
+coro_bus_channel_notify(struct coro_bus_channel *chan)
+{
+	chan->stats.wakeup_count +=
+		wakeup_queue_wakeup_all(&chan->select_queue);
+}
 
-	while (!chan->send_queue.empty()) {
-		coro_wakeup(chan->send_queue.front());
-		chan->send_queue.pop();
+/**
+ * Append as many messages as fit. The free space is at most two
+ * ranges of the ring - before and after the wrap.
+ */
+static size_t
+coro_bus_channel_push_v(struct coro_bus_channel *chan, const char *data,
+	size_t count)
+{
+	size_t space = chan->size_limit - chan->count - chan->reserved;
+	if (count > space)
+		count = space;
+	size_t size = chan->elem_size;
+	size_t tail = (chan->head + chan->count) & chan->ring_mask;
+	size_t first = chan->ring_mask + 1 - tail;
+	if (first > count)
+		first = count;
+	memcpy(chan->ring + tail * size, data, first * size);
+	memcpy(chan->ring, data + first * size, (count - first) * size);
+	chan->count += count;
+	chan->stats.send_count += count;
+	if (chan->count > chan->stats.depth_max)
+		chan->stats.depth_max = chan->count;
+	return count;
+}
+
+/** Take as many messages as there are, up to the capacity. */
+static size_t
+coro_bus_channel_pop_v(struct coro_bus_channel *chan, char *data,
+	size_t capacity)
+{
+	size_t count = chan->count;
+	if (count > capacity)
+		count = capacity;
+	size_t size = chan->elem_size;
+	size_t first = chan->ring_mask + 1 - chan->head;
+	if (first > count)
+		first = count;
+	memcpy(data, chan->ring + chan->head * size, first * size);
+	memcpy(data + first * size, chan->ring, (count - first) * size);
+	chan->head = (chan->head + count) & chan->ring_mask;
+	chan->count -= count;
+	chan->stats.recv_count += count;
+	return count;
+}
+
+/**
+ * Send as many messages as can be sent right now. The waiting
+ * receivers get them into their buffers directly, the rest goes to
+ * the ring. The messages are counted as if all went through the
+ * ring, so a send doesn't take more than the free space. Only a
+ * zero-capacity channel is limited by the receivers instead.
+ */
+static size_t
+coro_bus_channel_send_v(struct coro_bus_channel *chan, const char *data,
+	size_t count)
+{
+	size_t size = chan->elem_size;
+	size_t space = chan->size_limit - chan->count - chan->reserved;
+	if (chan->size_limit > 0 && count > space)
+		count = space;
+	size_t sent = 0;
+	struct wakeup_entry *receiver;
+	while (sent < count &&
+	       (receiver = wakeup_queue_first(&chan->recv_queue)) != NULL) {
+		assert(chan->count == 0);
+		size_t part = count - sent;
+		if (part > receiver->count)
+			part = receiver->count;
+		memcpy(receiver->data, data + sent * size, part * size);
+		wakeup_entry_advance(receiver, part, size);
+		++chan->stats.wakeup_count;
+		sent += part;
 	}
+	chan->stats.send_count += sent;
+	chan->stats.recv_count += sent;
+	return sent + coro_bus_channel_push_v(chan, data + sent * size,
+		count - sent);
+}
 
-	while(!chan->recv_queue.empty()) {
-		coro_wakeup(chan->recv_queue.front());
-		chan->recv_queue.pop();
+/**
+ * A broadcast waits for space in the channel. If this is the last
+ * channel it waits for, reserve a slot for it - it is woken up and
+ * checks the others. A parked broadcast holds no slots, otherwise
+ * two of them could hold what the other one waits for forever. A
+ * zero-capacity channel has no slots, there the broadcast is told
+ * that a receiver waits, and checks it later.
+ */
+static void
+coro_bus_channel_wakeup_broadcast(struct coro_bus_channel *chan,
+	struct wakeup_entry *entry)
+{
+	struct coro_bus_broadcast_target *target =
+		(struct coro_bus_broadcast_target *)entry;
+	if (chan->size_limit > 0) {
+		if (coro_bus_channel_is_full(chan))
+			return;
+		if (*target->blocked == 1) {
+			++chan->reserved;
+			target->is_reserved = true;
+		}
 	}
+	rlist_del_entry(entry, base);
+	target->is_waiting = false;
+	if (--*target->blocked == 0) {
+		coro_wakeup(entry->coro);
+		++chan->stats.wakeup_count;
+	}
+}
 
-	bus->channels[channel].reset();
+/**
+ * Fill the free space of the ring from the waiting senders, in
+ * their order, until it ends or nobody waits. Only the senders
+ * whose messages are moved are woken up, each once. A waiting
+ * broadcast has no data, it gets a reserved slot instead.
+ */
+static void
+coro_bus_channel_refill(struct coro_bus_channel *chan)
+{
+	struct wakeup_entry *sender;
+	while (!coro_bus_channel_is_full(chan) &&
+	       (sender = wakeup_queue_first(&chan->send_queue)) != NULL) {
+		if (sender->count == 0) {
+			coro_bus_channel_wakeup_broadcast(chan, sender);
+			continue;
+		}
+		size_t sent = coro_bus_channel_push_v(chan, sender->data,
+			sender->count);
+		wakeup_entry_advance(sender, sent, chan->elem_size);
+		++chan->stats.wakeup_count;
+	}
 }
 
-int
-coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+/**
+ * Receive as many messages as there are, up to the capacity. The
+ * freed space is filled from the waiting senders right away, and
+ * without buffered messages they are taken from the senders
+ * directly.
+ */
+static size_t
+coro_bus_channel_recv_v(struct coro_bus_channel *chan, char *data,
+	size_t capacity)
 {
-	if ((channel >= bus->channel_count) || (!bus->channels.at(channel).has_value())) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
+	if (chan->count > 0) {
+		size_t count = coro_bus_channel_pop_v(chan, data, capacity);
+		coro_bus_channel_refill(chan);
+		return count;
 	}
+	size_t size = chan->elem_size;
+	size_t count = 0;
+	struct wakeup_entry *sender;
+	while (count < capacity &&
+	       (sender = wakeup_queue_first(&chan->send_queue)) != NULL) {
+		if (sender->count == 0) {
+			/* Only a receiver left empty-handed can wait. */
+			if (count == 0)
+				coro_bus_channel_wakeup_broadcast(chan, sender);
+			break;
+		}
+		size_t part = capacity - count;
+		if (part > sender->count)
+			part = sender->count;
+		memcpy(data + count * size, sender->data, part * size);
+		wakeup_entry_advance(sender, part, size);
+		++chan->stats.wakeup_count;
+		count += part;
+	}
+	chan->stats.send_count += count;
+	chan->stats.recv_count += count;
+	return count;
+}
 
-	auto &chan = bus->channels.at(channel);
+/**
+ * Find a channel by descriptor. The result must be looked up again
+ * after a suspension - the channel could be closed meanwhile, or
+ * even closed and reopened under the same descriptor. The latter is
+ * detected by the generation.
+ */
+static struct coro_bus_channel *
+coro_bus_channel_get(struct coro_bus *bus, int channel)
+{
+	if (channel < 0 || (size_t)channel >= bus->slots.size())
+		return NULL;
+	return bus->slots[channel].chan;
+}
 
-	while (true) {
+////////////////////////////////////////////////////////////////////////////////
 
-		if (!chan.has_value()) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-			return -1;
-		}
+struct coro_bus *
+coro_bus_new(void)
+{
+	struct coro_bus *bus = new coro_bus();
+	bus->free_head = -1;
+	return bus;
+}
 
-		if (chan->data.size() == chan->size_limit) {
-			struct coro *current = coro_this();
-			chan->send_queue.push(current);
-			coro_suspend();
-			continue;
-		}
+void
+coro_bus_delete(struct coro_bus *bus)
+{
+	for (size_t i = 0; i < bus->slots.size(); ++i)
+		coro_bus_channel_close(bus, i);
+	assert(bus->live.empty());
+	delete bus;
+}
 
-		chan->data.push(data);
+/**
+ * A message shared by many channels. The payload follows the
+ * header in the same allocation.
+ */
+struct coro_bus_msg {
+	/** References - by the owners and by the channels. */
+	long refs;
+	/** Payload size. */
+	size_t size;
+};
 
-		if (!chan->data.empty() && !chan->recv_queue.empty()) {
-			struct coro *next_recv = chan->recv_queue.front();
-			chan->recv_queue.pop();
-			coro_wakeup(next_recv);
-		}
+struct coro_bus_msg *
+coro_bus_msg_new(const void *data, size_t size)
+{
+	struct coro_bus_msg *msg = (struct coro_bus_msg *)
+		malloc(sizeof(*msg) + size);
+	if (msg == NULL)
+		abort();
+	msg->refs = 1;
+	msg->size = size;
+	memcpy(msg + 1, data, size);
+	return msg;
+}
 
-		return 0;
-	}
+const void *
+coro_bus_msg_data(const struct coro_bus_msg *msg)
+{
+	return msg + 1;
 }
 
-int
-coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+size_t
+coro_bus_msg_size(const struct coro_bus_msg *msg)
 {
-	if ((channel >= bus->channel_count) || (!bus->channels.at(channel).has_value())) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
+	return msg->size;
+}
 
-	auto &chan = bus->channels.at(channel);
+void
+coro_bus_msg_ref(struct coro_bus_msg *msg)
+{
+	__atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+}
 
-	if (chan->data.size() == chan->size_limit) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return -1;
-	}
+void
+coro_bus_msg_unref(struct coro_bus_msg *msg)
+{
+	if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(msg);
+}
 
-	chan->data.push(data);
+int
+coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+{
+	return coro_bus_channel_open_sized(bus, size_limit, sizeof(unsigned));
+}
 
-	if (!chan->data.empty() && !chan->recv_queue.empty()) {
-		struct coro *next_recv = chan->recv_queue.front();
-		chan->recv_queue.pop();
-		coro_wakeup(next_recv);
+int
+coro_bus_channel_open_sized(struct coro_bus *bus, size_t size_limit,
+	size_t elem_size)
+{
+	assert(elem_size > 0);
+	int i = bus->free_head;
+	if (i >= 0) {
+		bus->free_head = bus->slots[i].next_free;
+	} else {
+		i = bus->slots.size();
+		bus->slots.push_back({NULL, 0, -1});
 	}
-
-	return 0;
+	struct coro_bus_slot *slot = &bus->slots[i];
+	struct coro_bus_channel *chan = coro_bus_channel_new(size_limit,
+		elem_size);
+	chan->descriptor = i;
+	chan->generation = slot->generation;
+	chan->live_index = bus->live.size();
+	bus->live.push_back(chan);
+	slot->chan = chan;
+	return i;
 }
 
 int
-coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+coro_bus_channel_open_shared(struct coro_bus *bus, size_t size_limit)
 {
-	if ((channel >= bus->channel_count) || (!bus->channels.at(channel).has_value())) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
+	int channel = coro_bus_channel_open_sized(bus, size_limit,
+		sizeof(struct coro_bus_msg *));
+	coro_bus_channel_get(bus, channel)->is_shared = true;
+	return channel;
+}
+
+void
+coro_bus_channel_close(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return;
 
-	auto &chan = bus->channels.at(channel);
+	wakeup_queue_wakeup_all(&chan->send_queue);
+	wakeup_queue_wakeup_all(&chan->recv_queue);
+	coro_bus_channel_notify(chan);
+	struct coro_bus_slot *slot = &bus->slots[channel];
+	slot->chan = NULL;
+	++slot->generation;
+	slot->next_free = bus->free_head;
+	bus->free_head = channel;
+	/* Keep the live list dense - the last channel takes the place. */
+	struct coro_bus_channel *last = bus->live.back();
+	bus->live[chan->live_index] = last;
+	last->live_index = chan->live_index;
+	bus->live.pop_back();
+	struct coro_bus_msg *msg;
+	while (chan->is_shared &&
+	       coro_bus_channel_pop_v(chan, (char *)&msg, 1) > 0)
+		coro_bus_msg_unref(msg);
+	coro_bus_channel_delete(chan);
+}
 
+/**
+ * Send as many messages as fit, waiting for space if the channel is
+ * full and blocking is allowed.
+ */
+static int
+coro_bus_send_impl(struct coro_bus *bus, int channel, const void *data,
+	size_t elem_size, unsigned count, bool is_blocking)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	unsigned generation = chan != NULL ? chan->generation : 0;
 	while (true) {
-
-		if (!chan.has_value()) {
+		if (chan == NULL || chan->generation != generation) {
 			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 			return -1;
 		}
-
-		if (chan->data.empty()) {
-			struct coro *current = coro_this();
-			chan->recv_queue.push(current);
-			coro_suspend();
-			continue;
+		if (chan->elem_size != elem_size) {
+			coro_bus_errno_set(CORO_BUS_ERR_WRONG_SIZE);
+			return -1;
 		}
-
-		*data = chan->data.front();
-		chan->data.pop();
-
-		if (!chan->send_queue.empty() && (chan->data.size() < chan->size_limit)) {
-			struct coro *next_send = chan->send_queue.front();
-			chan->send_queue.pop();
-			coro_wakeup(next_send);
+		/* Nothing to send, and nothing to wait for. */
+		if (count == 0)
+			return 0;
+		if (coro_bus_channel_can_send(chan)) {
+			size_t sent = coro_bus_channel_send_v(chan,
+				(const char *)data, count);
+			if (sent > 0) {
+				coro_bus_channel_notify(chan);
+				return sent;
+			}
 		}
-
-		return 0;
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		/* A waiting sender makes a zero-capacity channel readable. */
+		coro_bus_channel_notify(chan);
+		++chan->stats.send_wait_count;
+		uint64_t start = coro_bus_clock_ns();
+		unsigned sent = wakeup_queue_suspend_this(&chan->send_queue,
+			(char *)data, count);
+		chan = coro_bus_channel_get(bus, channel);
+		if (chan != NULL && chan->generation == generation)
+			chan->stats.send_wait_ns += coro_bus_clock_ns() - start;
+		if (sent > 0)
+			return sent;
 	}
 }
 
-int
-coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+/**
+ * Receive as many messages as there are, up to the capacity,
+ * waiting for them if the channel is empty and blocking is allowed.
+ */
+static int
+coro_bus_recv_impl(struct coro_bus *bus, int channel, void *data,
+	size_t elem_size, unsigned capacity, bool is_blocking)
 {
-	if ((channel >= bus->channel_count) || (!bus->channels.at(channel).has_value())) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	unsigned generation = chan != NULL ? chan->generation : 0;
+	while (true) {
+		if (chan == NULL || chan->generation != generation) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		if (chan->elem_size != elem_size) {
+			coro_bus_errno_set(CORO_BUS_ERR_WRONG_SIZE);
+			return -1;
+		}
+		if (capacity == 0)
+			return 0;
+		size_t received = coro_bus_channel_recv_v(chan, (char *)data,
+			capacity);
+		if (received > 0) {
+			coro_bus_channel_notify(chan);
+			return received;
+		}
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		/* A waiting receiver makes a zero-capacity channel writable. */
+		coro_bus_channel_notify(chan);
+		++chan->stats.recv_wait_count;
+		uint64_t start = coro_bus_clock_ns();
+		received = wakeup_queue_suspend_this(&chan->recv_queue,
+			(char *)data, capacity);
+		chan = coro_bus_channel_get(bus, channel);
+		if (chan != NULL && chan->generation == generation)
+			chan->stats.recv_wait_ns += coro_bus_clock_ns() - start;
+		if (received > 0)
+			return received;
 	}
+}
 
-	auto &chan = bus->channels.at(channel);
+int
+coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return coro_bus_send_raw(bus, channel, &data, sizeof(data), 1) < 0 ?
+		-1 : 0;
+}
 
-	if (chan->data.empty()) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return -1;
-	}
+int
+coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return coro_bus_try_send_raw(bus, channel, &data, sizeof(data), 1) < 0 ?
+		-1 : 0;
+}
 
-	*data = chan->data.front();
-	chan->data.pop();
+int
+coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	return coro_bus_recv_raw(bus, channel, data, sizeof(*data), 1) < 0 ?
+		-1 : 0;
+}
 
-	if (!chan->send_queue.empty() && (chan->data.size() < chan->size_limit)) {
-		struct coro *next_send = chan->send_queue.front();
-		chan->send_queue.pop();
-		coro_wakeup(next_send);
-	}
+int
+coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	return coro_bus_try_recv_raw(bus, channel, data, sizeof(*data), 1) < 0 ?
+		-1 : 0;
+}
 
-	return 0;
+int
+coro_bus_send_raw(struct coro_bus *bus, int channel, const void *data,
+	size_t elem_size, unsigned count)
+{
+	return coro_bus_send_impl(bus, channel, data, elem_size, count, true);
 }
 
+int
+coro_bus_try_send_raw(struct coro_bus *bus, int channel, const void *data,
+	size_t elem_size, unsigned count)
+{
+	return coro_bus_send_impl(bus, channel, data, elem_size, count, false);
+}
 
-#if NEED_BROADCAST
+int
+coro_bus_recv_raw(struct coro_bus *bus, int channel, void *data,
+	size_t elem_size, unsigned capacity)
+{
+	return coro_bus_recv_impl(bus, channel, data, elem_size, capacity,
+		true);
+}
 
 int
-coro_bus_broadcast(struct coro_bus *bus, unsigned data)
+coro_bus_try_recv_raw(struct coro_bus *bus, int channel, void *data,
+	size_t elem_size, unsigned capacity)
 {
-	bool is_any_channel_presented, exists_blocked_chan = false;
-	std::optional<coro_bus_channel> *blocked_chan;
+	return coro_bus_recv_impl(bus, channel, data, elem_size, capacity,
+		false);
+}
 
-	for (auto &chan: bus->channels) {
-		if (chan.has_value()) {
-			is_any_channel_presented = true;
-			break;
-		}
-	}
+/** A select waiting in one of the channels. */
+struct coro_bus_select_waiter {
+	struct wakeup_entry entry;
+	/** Generation of the channel when the select started. */
+	unsigned generation;
+};
 
-	if (!is_any_channel_presented) {
+/**
+ * Ready events of a select item. A channel which is gone is reported
+ * having all the requested events, so the next call gets the error.
+ */
+static int
+coro_bus_select_check(struct coro_bus *bus,
+	const struct coro_bus_select_item *item, unsigned generation)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus,
+		item->channel);
+	if (chan == NULL || chan->generation != generation)
+		return item->events;
+	int ready = 0;
+	if ((item->events & CORO_BUS_SELECT_RECV) != 0 &&
+	    coro_bus_channel_can_recv(chan))
+		ready |= CORO_BUS_SELECT_RECV;
+	if ((item->events & CORO_BUS_SELECT_SEND) != 0 &&
+	    coro_bus_channel_can_send(chan))
+		ready |= CORO_BUS_SELECT_SEND;
+	return ready;
+}
+
+int
+coro_bus_select(struct coro_bus *bus, struct coro_bus_select_item *items,
+	unsigned count, uint64_t timeout_ns)
+{
+	/* Nothing could ever wake it up. */
+	if (count == 0) {
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
-
-	while (true)
-	{
-		exists_blocked_chan = false;
-		is_any_channel_presented = false;
-
-		for (auto &chan: bus->channels) {
-			if (!chan.has_value())
-				continue;
-
-			is_any_channel_presented = true;
-
-			if (chan->data.size() == chan->size_limit) {
-				exists_blocked_chan = true;
-				blocked_chan = &chan;
-				break;
-			}
+	/* Most of the selects are small, they don't allocate. */
+	struct coro_bus_select_waiter local[8];
+	std::vector<struct coro_bus_select_waiter> big;
+	struct coro_bus_select_waiter *waiters = local;
+	if (count > sizeof(local) / sizeof(local[0])) {
+		big.resize(count);
+		waiters = big.data();
+	}
+	for (unsigned i = 0; i < count; ++i) {
+		struct coro_bus_channel *chan = coro_bus_channel_get(bus,
+			items[i].channel);
+		waiters[i].generation = chan != NULL ? chan->generation : 0;
+		waiters[i].entry.coro = coro_this();
+		waiters[i].entry.data = NULL;
+		waiters[i].entry.count = 0;
+		waiters[i].entry.result = 0;
+	}
+	uint64_t deadline = UINT64_MAX;
+	if (timeout_ns != UINT64_MAX) {
+		uint64_t now = coro_bus_clock_ns();
+		if (timeout_ns < UINT64_MAX - now)
+			deadline = now + timeout_ns;
+	}
+	while (true) {
+		int first = -1;
+		for (unsigned i = 0; i < count; ++i) {
+			items[i].ready = coro_bus_select_check(bus, &items[i],
+				waiters[i].generation);
+			if (items[i].ready != 0 && first < 0)
+				first = i;
 		}
-
-		if (!is_any_channel_presented) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		if (first >= 0)
+			return first;
+		uint64_t now = deadline != UINT64_MAX ? coro_bus_clock_ns() : 0;
+		if (timeout_ns == 0 || now >= deadline) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 			return -1;
 		}
-
-		if (exists_blocked_chan) {
-			struct coro *current = coro_this();
-			(*blocked_chan)->send_queue.push(current);
-			coro_suspend();
-			continue;
+		/* All the channels exist, or the select would be ready. */
+		for (unsigned i = 0; i < count; ++i) {
+			struct coro_bus_channel *chan =
+				coro_bus_channel_get(bus, items[i].channel);
+			rlist_add_tail_entry(&chan->select_queue.coros,
+				&waiters[i].entry, base);
 		}
-
-		for (auto &chan: bus->channels) {
-			if (!chan.has_value())
-				continue;
-			
-			chan->data.push(data);
-			if (!chan->recv_queue.empty()) {
-				struct coro *next_recv = chan->recv_queue.front();
-				chan->recv_queue.pop();
-				coro_wakeup(next_recv);
-			}
-		}
-
-		return 0;
+		if (deadline == UINT64_MAX)
+			coro_suspend();
+		else
+			coro_suspend_timeout(deadline - now);
+		/*
+		 * A waker unlinks only its own entry, and a closed channel
+		 * unlinks all of them, so the rest are still linked.
+		 */
+		for (unsigned i = 0; i < count; ++i)
+			rlist_del_entry(&waiters[i].entry, base);
 	}
 }
 
 int
-coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats)
 {
-	bool is_any_channel_presented, exists_blocked_chan = false;
-
-	for (auto &chan: bus->channels) {
-		if (chan.has_value()) {
-			is_any_channel_presented = true;
-			break;
-		}
-	}
-
-	if (!is_any_channel_presented) {
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL) {
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
+	*stats = chan->stats;
+	stats->depth = chan->count;
+	return 0;
+}
 
-	exists_blocked_chan = false;
-	is_any_channel_presented = false;
-
-	for (auto &chan: bus->channels) {
-		if (!chan.has_value())
+void
+coro_bus_dump(struct coro_bus *bus, FILE *out)
+{
+	fprintf(out, "bus %p: channels %zu\n", (void *)bus, bus->live.size());
+	for (size_t i = 0; i < bus->slots.size(); ++i) {
+		struct coro_bus_channel *chan = bus->slots[i].chan;
+		if (chan == NULL)
 			continue;
+		const struct coro_bus_channel_stats *st = &chan->stats;
+		fprintf(out, "  channel %zu: limit %zu, depth %zu (max %zu), "
+			"sent %llu, received %llu, send waits %llu (%llu us), "
+			"recv waits %llu (%llu us), wakeups %llu\n", i,
+			chan->size_limit, chan->count, st->depth_max,
+			(unsigned long long)st->send_count,
+			(unsigned long long)st->recv_count,
+			(unsigned long long)st->send_wait_count,
+			(unsigned long long)(st->send_wait_ns / 1000),
+			(unsigned long long)st->recv_wait_count,
+			(unsigned long long)(st->recv_wait_ns / 1000),
+			(unsigned long long)st->wakeup_count);
+	}
+}
 
-		is_any_channel_presented = true;
 
-		if (chan->data.size() == chan->size_limit) {
-			exists_blocked_chan = true;
-			break;
-		}
-	}
+////////////////////////////////////////////////////////////////////////////////
 
-	if (!is_any_channel_presented) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
+/**
+ * A coroutine waiting in an MPMC channel. Lives on its stack. The
+ * other side pops it from the list and signals the remote wakeup,
+ * which is to be delivered before the waiter can leave.
+ */
+struct coro_bus_mpmc_waiter {
+	struct coro_remote remote;
+	struct rlist link;
+};
 
-	if (exists_blocked_chan) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return -1;
-	}
+/** Coroutines waiting on one side of an MPMC channel. */
+struct coro_bus_mpmc_queue {
+	/** Protects the list. */
+	int lock;
+	/** Size of the list, readable without the lock. */
+	unsigned count;
+	struct rlist waiters;
+};
 
-	for (auto &chan: bus->channels) {
-		if (!chan.has_value())
-			continue;
-			
-		chan->data.push(data);
-		if (!chan->recv_queue.empty()) {
-			struct coro *next_recv = chan->recv_queue.front();
-			chan->recv_queue.pop();
-			coro_wakeup(next_recv);
-		}
-	}
+/**
+ * Bounded MPMC queue of Dmitry Vyukov. Each slot has a sequence
+ * number telling whose turn it is: equal to the position means free
+ * for the sender which got that position, the position + 1 means
+ * full for the receiver which got it. The positions are taken via
+ * CAS, and the slots are filled and emptied in parallel.
+ */
+struct coro_bus_mpmc {
+	alignas(64) size_t send_pos;
+	alignas(64) size_t recv_pos;
+	alignas(64) size_t mask;
+	size_t elem_size;
+	size_t *seqs;
+	char *ring;
+	struct coro_bus_mpmc_queue send_queue;
+	struct coro_bus_mpmc_queue recv_queue;
+};
 
-	return 0;
+static void
+coro_bus_mpmc_queue_create(struct coro_bus_mpmc_queue *queue)
+{
+	queue->lock = 0;
+	queue->count = 0;
+	rlist_create(&queue->waiters);
 }
 
-#endif
-
-#if NEED_BATCH
+/**
+ * Put the current coroutine into the queue. The caller has to try
+ * again after that and only then suspend, because the other side
+ * could make its move before noticing the waiter.
+ */
+static void
+coro_bus_mpmc_queue_add(struct coro_bus_mpmc_queue *queue,
+	struct coro_bus_mpmc_waiter *w)
+{
+	coro_remote_start(&w->remote);
+	coro_spin_lock(&queue->lock);
+	rlist_add_tail_entry(&queue->waiters, w, link);
+	__atomic_store_n(&queue->count, queue->count + 1, __ATOMIC_RELAXED);
+	coro_spin_unlock(&queue->lock);
+	/* Pairs with the fence in coro_bus_mpmc_queue_wakeup_first(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
 
-int
-coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+/**
+ * Leave the queue without waiting, when the retry has succeeded.
+ * When still in the list, nobody is going to signal the waiter, and
+ * the wakeup is just cancelled. Otherwise it can be on the way, and
+ * has to be taken.
+ */
+static void
+coro_bus_mpmc_queue_remove(struct coro_bus_mpmc_queue *queue,
+	struct coro_bus_mpmc_waiter *w)
 {
-	if ((channel >= bus->channel_count) || (!bus->channels.at(channel).has_value())) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
+	coro_spin_lock(&queue->lock);
+	bool is_linked = !rlist_empty(&w->link);
+	if (is_linked) {
+		rlist_del_entry(w, link);
+		__atomic_store_n(&queue->count, queue->count - 1,
+			__ATOMIC_RELAXED);
 	}
+	coro_spin_unlock(&queue->lock);
+	if (is_linked)
+		coro_remote_cancel(&w->remote);
+	else
+		coro_remote_wait(&w->remote);
+}
 
-	auto &chan = bus->channels.at(channel);
+/** Wake up the first waiter of the queue, if there is any. */
+static void
+coro_bus_mpmc_queue_wakeup_first(struct coro_bus_mpmc_queue *queue)
+{
+	/* The message or the space is published, now look for waiters. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->count, __ATOMIC_RELAXED) == 0)
+		return;
+	struct coro_bus_mpmc_waiter *w = NULL;
+	coro_spin_lock(&queue->lock);
+	if (!rlist_empty(&queue->waiters)) {
+		w = rlist_shift_entry(&queue->waiters,
+			struct coro_bus_mpmc_waiter, link);
+		__atomic_store_n(&queue->count, queue->count - 1,
+			__ATOMIC_RELAXED);
+	}
+	coro_spin_unlock(&queue->lock);
+	/* The waiter can't leave until gets the signal. */
+	if (w != NULL)
+		coro_remote_signal(&w->remote);
+}
 
+static bool
+coro_bus_mpmc_push(struct coro_bus_mpmc *mpmc, const void *data)
+{
+	size_t pos = __atomic_load_n(&mpmc->send_pos, __ATOMIC_RELAXED);
+	size_t *seq;
 	while (true) {
-		if (!chan.has_value()) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-			return -1;
+		seq = &mpmc->seqs[pos & mpmc->mask];
+		intptr_t diff = (intptr_t)__atomic_load_n(seq,
+			__ATOMIC_ACQUIRE) - (intptr_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&mpmc->send_pos,
+					&pos, pos + 1, true, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* The slot isn't received yet after the last lap. */
+			return false;
+		} else {
+			pos = __atomic_load_n(&mpmc->send_pos,
+				__ATOMIC_RELAXED);
 		}
+	}
+	memcpy(mpmc->ring + (pos & mpmc->mask) * mpmc->elem_size, data,
+		mpmc->elem_size);
+	__atomic_store_n(seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
 
-		if (chan->data.size() == chan->size_limit) {
-			struct coro *current = coro_this();
-			chan->send_queue.push(current);
-			coro_suspend();
-			continue;
+static bool
+coro_bus_mpmc_pop(struct coro_bus_mpmc *mpmc, void *data)
+{
+	size_t pos = __atomic_load_n(&mpmc->recv_pos, __ATOMIC_RELAXED);
+	size_t *seq;
+	while (true) {
+		seq = &mpmc->seqs[pos & mpmc->mask];
+		intptr_t diff = (intptr_t)__atomic_load_n(seq,
+			__ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&mpmc->recv_pos,
+					&pos, pos + 1, true, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* The slot isn't sent yet. */
+			return false;
+		} else {
+			pos = __atomic_load_n(&mpmc->recv_pos,
+				__ATOMIC_RELAXED);
 		}
+	}
+	memcpy(data, mpmc->ring + (pos & mpmc->mask) * mpmc->elem_size,
+		mpmc->elem_size);
+	/* Free for the sender of the next lap. */
+	__atomic_store_n(seq, pos + mpmc->mask + 1, __ATOMIC_RELEASE);
+	return true;
+}
 
-		size_t sended_messages = 0;
+struct coro_bus_mpmc *
+coro_bus_mpmc_new(size_t size_limit, size_t elem_size)
+{
+	struct coro_bus_mpmc *mpmc = new coro_bus_mpmc();
+	size_t ring_size = 2;
+	while (ring_size < size_limit)
+		ring_size <<= 1;
+	mpmc->send_pos = 0;
+	mpmc->recv_pos = 0;
+	mpmc->mask = ring_size - 1;
+	mpmc->elem_size = elem_size;
+	mpmc->seqs = new size_t[ring_size];
+	for (size_t i = 0; i < ring_size; ++i)
+		mpmc->seqs[i] = i;
+	mpmc->ring = new char[ring_size * elem_size];
+	coro_bus_mpmc_queue_create(&mpmc->send_queue);
+	coro_bus_mpmc_queue_create(&mpmc->recv_queue);
+	return mpmc;
+}
 
-		while ((sended_messages != count) && (chan->data.size() != chan->size_limit)) {
-			chan->data.push(*(data + sended_messages));
-			++sended_messages;
-		}
+void
+coro_bus_mpmc_delete(struct coro_bus_mpmc *mpmc)
+{
+	assert(rlist_empty(&mpmc->send_queue.waiters));
+	assert(rlist_empty(&mpmc->recv_queue.waiters));
+	delete[] mpmc->seqs;
+	delete[] mpmc->ring;
+	delete mpmc;
+}
 
-		if (!chan->data.empty() && !chan->recv_queue.empty()) {
-			struct coro *next_recv = chan->recv_queue.front();
-			chan->recv_queue.pop();
-			coro_wakeup(next_recv);
+static int
+coro_bus_mpmc_send_impl(struct coro_bus_mpmc *mpmc, const void *data,
+	bool is_blocking)
+{
+	while (!coro_bus_mpmc_push(mpmc, data)) {
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		struct coro_bus_mpmc_waiter w;
+		coro_bus_mpmc_queue_add(&mpmc->send_queue, &w);
+		if (coro_bus_mpmc_push(mpmc, data)) {
+			coro_bus_mpmc_queue_remove(&mpmc->send_queue, &w);
+			break;
 		}
+		coro_remote_wait(&w.remote);
+	}
+	coro_bus_mpmc_queue_wakeup_first(&mpmc->recv_queue);
+	return 0;
+}
 
-		return sended_messages;
+static int
+coro_bus_mpmc_recv_impl(struct coro_bus_mpmc *mpmc, void *data,
+	bool is_blocking)
+{
+	while (!coro_bus_mpmc_pop(mpmc, data)) {
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		struct coro_bus_mpmc_waiter w;
+		coro_bus_mpmc_queue_add(&mpmc->recv_queue, &w);
+		if (coro_bus_mpmc_pop(mpmc, data)) {
+			coro_bus_mpmc_queue_remove(&mpmc->recv_queue, &w);
+			break;
+		}
+		coro_remote_wait(&w.remote);
 	}
+	coro_bus_mpmc_queue_wakeup_first(&mpmc->send_queue);
+	return 0;
 }
 
 int
-coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+coro_bus_mpmc_send(struct coro_bus_mpmc *mpmc, const void *data)
 {
-	if ((channel >= bus->channel_count) || (!bus->channels.at(channel).has_value())) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
+	return coro_bus_mpmc_send_impl(mpmc, data, true);
+}
 
-	auto &chan = bus->channels.at(channel);
+int
+coro_bus_mpmc_try_send(struct coro_bus_mpmc *mpmc, const void *data)
+{
+	return coro_bus_mpmc_send_impl(mpmc, data, false);
+}
 
-	if (!chan.has_value()) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
+int
+coro_bus_mpmc_recv(struct coro_bus_mpmc *mpmc, void *data)
+{
+	return coro_bus_mpmc_recv_impl(mpmc, data, true);
+}
 
-	if (chan->data.size() == chan->size_limit) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return - 1;
-	}
+int
+coro_bus_mpmc_try_recv(struct coro_bus_mpmc *mpmc, void *data)
+{
+	return coro_bus_mpmc_recv_impl(mpmc, data, false);
+}
 
-	size_t sended_messages = 0;
+#if NEED_BROADCAST
 
-	while ((sended_messages != count) && (chan->data.size() != chan->size_limit)) {
-		chan->data.push(*(data + sended_messages));
-		++sended_messages;
-	}
+/** The channel takes the broadcast messages of this kind. */
+static inline bool
+coro_bus_channel_is_target(const struct coro_bus_channel *chan,
+	size_t elem_size, bool is_shared)
+{
+	return chan->elem_size == elem_size && chan->is_shared == is_shared;
+}
 
-	if (!chan->data.empty() && !chan->recv_queue.empty()) {
-		struct coro *next_recv = chan->recv_queue.front();
-		chan->recv_queue.pop();
-		coro_wakeup(next_recv);
-	}
+/** Put a broadcast message into a channel, into its slot if reserved. */
+static void
+coro_bus_broadcast_push(struct coro_bus_channel *chan, const void *data,
+	bool is_shared, bool is_reserved)
+{
+	if (is_reserved)
+		--chan->reserved;
+	if (is_shared)
+		coro_bus_msg_ref(*(struct coro_bus_msg *const *)data);
+	size_t sent = coro_bus_channel_send_v(chan, (const char *)data, 1);
+	assert(sent == 1);
+	(void)sent;
+	/* The slot could be taken by a receiver, then a sender gets it. */
+	coro_bus_channel_refill(chan);
+	coro_bus_channel_notify(chan);
+}
 
-	return sended_messages;
+/** Channel of a target, if it is not gone. */
+static struct coro_bus_channel *
+coro_bus_broadcast_target_channel(struct coro_bus *bus,
+	const struct coro_bus_broadcast_target *target)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus,
+		target->channel);
+	if (chan == NULL || chan->generation != target->generation)
+		return NULL;
+	return chan;
 }
 
-int
-coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+/** Give the reserved slot back, to the waiting senders if any. */
+static void
+coro_bus_broadcast_release(struct coro_bus_channel *chan)
 {
-	if ((channel >= bus->channel_count) || (!bus->channels.at(channel).has_value())) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
+	assert(chan->reserved > 0);
+	--chan->reserved;
+	coro_bus_channel_refill(chan);
+	coro_bus_channel_notify(chan);
+}
 
-	auto &chan = bus->channels.at(channel);
+/**
+ * Wait until all the targets have space, and send. The broadcast
+ * waits in each full channel and is woken up when all of them had
+ * space, the last one reserving a slot for it. If some other became
+ * full meanwhile, the slot is given back and the broadcast waits
+ * again - it never sleeps holding a slot. The targets are the
+ * channels at the start, the closed ones are skipped.
+ * Returns false if all of them are closed.
+ */
+static bool
+coro_bus_broadcast_wait(struct coro_bus *bus, const void *data,
+	size_t elem_size, bool is_shared)
+{
+	struct coro_bus_broadcast_target local[8];
+	std::vector<struct coro_bus_broadcast_target> big;
+	struct coro_bus_broadcast_target *targets = local;
+	if (bus->live.size() > sizeof(local) / sizeof(local[0])) {
+		big.resize(bus->live.size());
+		targets = big.data();
+	}
+	unsigned blocked = 0;
+	size_t count = 0;
+	for (struct coro_bus_channel *chan : bus->live) {
+		if (!coro_bus_channel_is_target(chan, elem_size, is_shared))
+			continue;
+		struct coro_bus_broadcast_target *target = &targets[count++];
+		target->entry.coro = coro_this();
+		target->entry.data = NULL;
+		target->entry.count = 0;
+		target->entry.result = 0;
+		target->channel = chan->descriptor;
+		target->generation = chan->generation;
+		target->is_waiting = false;
+		target->is_reserved = false;
+		target->blocked = &blocked;
+	}
+	while (true) {
+		if (blocked == 0) {
+			bool is_any = false;
+			bool is_ready = true;
+			for (size_t i = 0; i < count; ++i) {
+				struct coro_bus_broadcast_target *target =
+					&targets[i];
+				struct coro_bus_channel *chan =
+					coro_bus_broadcast_target_channel(bus,
+						target);
+				if (chan == NULL)
+					continue;
+				is_any = true;
+				if (!target->is_reserved &&
+				    !coro_bus_channel_can_send(chan))
+					is_ready = false;
+			}
+			if (!is_any)
+				return false;
+			if (is_ready)
+				break;
+			for (size_t i = 0; i < count; ++i) {
+				struct coro_bus_broadcast_target *target =
+					&targets[i];
+				struct coro_bus_channel *chan =
+					coro_bus_broadcast_target_channel(bus,
+						target);
+				if (chan == NULL || !target->is_reserved)
+					continue;
+				target->is_reserved = false;
+				coro_bus_broadcast_release(chan);
+			}
+			for (size_t i = 0; i < count; ++i) {
+				struct coro_bus_broadcast_target *target =
+					&targets[i];
+				struct coro_bus_channel *chan =
+					coro_bus_broadcast_target_channel(bus,
+						target);
+				if (chan == NULL ||
+				    coro_bus_channel_can_send(chan))
+					continue;
+				target->is_waiting = true;
+				rlist_add_tail_entry(&chan->send_queue.coros,
+					&target->entry, base);
+				++blocked;
+			}
+			if (blocked == 0)
+				continue;
+		}
+		coro_suspend();
+		/* A closed channel wakes its waiters up and is skipped. */
+		for (size_t i = 0; i < count; ++i) {
+			struct coro_bus_broadcast_target *target = &targets[i];
+			if (target->is_waiting &&
+			    coro_bus_broadcast_target_channel(bus, target) ==
+			    NULL) {
+				target->is_waiting = false;
+				--blocked;
+			}
+		}
+	}
+	for (size_t i = 0; i < count; ++i) {
+		struct coro_bus_channel *chan =
+			coro_bus_broadcast_target_channel(bus, &targets[i]);
+		if (chan != NULL)
+			coro_bus_broadcast_push(chan, data, is_shared,
+				targets[i].is_reserved);
+	}
+	return true;
+}
 
-	while (true)
-	{
-		if (!chan.has_value()) {
+/**
+ * Send a message to all the channels of its kind. The channels of
+ * other messages can't take it, and are skipped.
+ */
+static int
+coro_bus_broadcast_impl(struct coro_bus *bus, const void *data,
+	size_t elem_size, bool is_shared, bool is_blocking)
+{
+	while (true) {
+		bool is_any = false;
+		bool is_ready = true;
+		for (struct coro_bus_channel *chan : bus->live) {
+			if (!coro_bus_channel_is_target(chan, elem_size,
+							is_shared))
+				continue;
+			is_any = true;
+			if (!coro_bus_channel_can_send(chan)) {
+				is_ready = false;
+				break;
+			}
+		}
+		if (!is_any) {
 			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 			return -1;
 		}
-
-		if (chan->data.empty()) {
-			struct coro *current = coro_this();
-			chan->recv_queue.push(current);
-			coro_suspend();
-			continue;
-		}
-
-		size_t recv_messages = 0;
-
-		while (!chan->data.empty() && (recv_messages != capacity)) {
-			*(data + recv_messages) = chan->data.front();
-			chan->data.pop();
-			++recv_messages;
+		if (is_ready)
+			break;
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
 		}
+		if (coro_bus_broadcast_wait(bus, data, elem_size, is_shared))
+			return 0;
+	}
+	for (struct coro_bus_channel *chan : bus->live) {
+		if (coro_bus_channel_is_target(chan, elem_size, is_shared))
+			coro_bus_broadcast_push(chan, data, is_shared, false);
+	}
+	return 0;
+}
 
-		if (!chan->send_queue.empty() && (chan->data.size() < chan->size_limit)) {
-			struct coro *next_send = chan->send_queue.front();
-			chan->send_queue.pop();
-			coro_wakeup(next_send);
-		}
+int
+coro_bus_broadcast(struct coro_bus *bus, unsigned data)
+{
+	return coro_bus_broadcast_impl(bus, &data, sizeof(data), false, true);
+}
 
-		return recv_messages;
-	}
+int
+coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+{
+	return coro_bus_broadcast_impl(bus, &data, sizeof(data), false, false);
 }
 
 int
-coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+coro_bus_broadcast_shared(struct coro_bus *bus, struct coro_bus_msg *msg)
 {
-	if ((channel >= bus->channel_count) || (!bus->channels.at(channel).has_value())) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
+	return coro_bus_broadcast_impl(bus, &msg, sizeof(msg), true, true);
+}
 
-	auto &chan = bus->channels.at(channel);
+int
+coro_bus_try_broadcast_shared(struct coro_bus *bus, struct coro_bus_msg *msg)
+{
+	return coro_bus_broadcast_impl(bus, &msg, sizeof(msg), true, false);
+}
 
-	if (!chan.has_value()) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
+#endif
 
-	if (chan->data.empty()) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return -1;
-	}
+#if NEED_BATCH
 
-	size_t recv_messages = 0;
+int
+coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+{
+	return coro_bus_send_raw(bus, channel, data, sizeof(*data), count);
+}
 
-	while (!chan->data.empty() && (recv_messages != capacity)) {
-		*(data + recv_messages) = chan->data.front();
-		chan->data.pop();
-		++recv_messages;
-	}
+int
+coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+{
+	return coro_bus_try_send_raw(bus, channel, data, sizeof(*data), count);
+}
 
-	if (!chan->send_queue.empty() && (chan->data.size() < chan->size_limit)) {
-		struct coro *next_send = chan->send_queue.front();
-		chan->send_queue.pop();
-		coro_wakeup(next_send);
-	}
+int
+coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+{
+	return coro_bus_recv_raw(bus, channel, data, sizeof(*data), capacity);
+}
 
-	return recv_messages;
+int
+coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+{
+	return coro_bus_try_recv_raw(bus, channel, data, sizeof(*data),
+		capacity);
 }
 
 #endif
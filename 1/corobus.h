@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 /**
  * Here you should specify which bonuses do you want via the
@@ -15,6 +17,7 @@ enum coro_bus_error_code {
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	CORO_BUS_ERR_WRONG_SIZE,
 };
 
 struct coro_bus;
@@ -43,7 +46,8 @@ coro_bus_delete(struct coro_bus *bus);
  * Create a channel inside the bus.
  * @param bus The bus to create the channel in.
  * @param size_limit Maximum messages a channel can hold in memory
- *     at once.
+ *     at once. With 0 the channel holds nothing, a message is only
+ *     handed from a sender to a waiting receiver or vice versa.
  *
  * @retval >=0 Descriptor of the channel. It must be passed to the
  *     send/recv functions.
@@ -126,11 +130,242 @@ coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
+/**
+ * Messages of any type are supported via the channels of a fixed
+ * message size. The messages are stored in the channel by value and
+ * are copied bytewise, so they must be trivially copyable. The
+ * functions above are the same for the messages of unsigned.
+ */
+
+/**
+ * Same as coro_bus_channel_open(), but the messages of the channel
+ * are @a elem_size bytes each. It must be > 0.
+ */
+int
+coro_bus_channel_open_sized(struct coro_bus *bus, size_t size_limit,
+	size_t elem_size);
+
+/**
+ * Send up to @a count messages of @a elem_size bytes each, waiting
+ * for space if the channel is full. Returns how many were sent, the
+ * same as coro_bus_send_v().
+ *
+ * @retval >=0 Success, how many messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel has messages of
+ *       another size.
+ */
+int
+coro_bus_send_raw(struct coro_bus *bus, int channel, const void *data,
+	size_t elem_size, unsigned count);
+
+/**
+ * Same as coro_bus_send_raw(), but fails instantly in case the
+ * channel is full, with CORO_BUS_ERR_WOULD_BLOCK.
+ */
+int
+coro_bus_try_send_raw(struct coro_bus *bus, int channel, const void *data,
+	size_t elem_size, unsigned count);
+
+/**
+ * Receive up to @a capacity messages of @a elem_size bytes each,
+ * waiting for them if the channel is empty. Returns how many were
+ * received, the same as coro_bus_recv_v().
+ *
+ * @retval >=0 Success, how many messages were received.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel has messages of
+ *       another size.
+ */
+int
+coro_bus_recv_raw(struct coro_bus *bus, int channel, void *data,
+	size_t elem_size, unsigned capacity);
+
+/**
+ * Same as coro_bus_recv_raw(), but fails instantly in case the
+ * channel is empty, with CORO_BUS_ERR_WOULD_BLOCK.
+ */
+int
+coro_bus_try_recv_raw(struct coro_bus *bus, int channel, void *data,
+	size_t elem_size, unsigned capacity);
+
+/**
+ * A message shared by many receivers, instead of a copy for each.
+ * It is reference counted and immutable. The references can be
+ * passed between the threads.
+ */
+struct coro_bus_msg;
+
+/** Create a message with a copy of @a data, and 1 reference. */
+struct coro_bus_msg *
+coro_bus_msg_new(const void *data, size_t size);
+
+const void *
+coro_bus_msg_data(const struct coro_bus_msg *msg);
+
+size_t
+coro_bus_msg_size(const struct coro_bus_msg *msg);
+
+void
+coro_bus_msg_ref(struct coro_bus_msg *msg);
+
+/** Drop a reference. The last one deletes the message. */
+void
+coro_bus_msg_unref(struct coro_bus_msg *msg);
+
+/**
+ * Create a channel of the shared messages. Its messages are
+ * references, struct coro_bus_msg *, and can be received with
+ * coro_bus_recv_raw(). The channel owns a reference for each message
+ * it holds, a receiver gets it and has to unref. The unreceived ones
+ * are unrefed on close.
+ */
+int
+coro_bus_channel_open_shared(struct coro_bus *bus, size_t size_limit);
+
+/** Counters of a channel, to see how it is loaded. */
+struct coro_bus_channel_stats {
+	/** Messages sent into the channel. */
+	uint64_t send_count;
+	/** Messages received from the channel. */
+	uint64_t recv_count;
+	/** Messages in the channel right now. */
+	size_t depth;
+	/** The most messages the channel ever had. */
+	size_t depth_max;
+	/** How many times a sender waited for space. */
+	uint64_t send_wait_count;
+	/** Total time of the senders waiting for space. */
+	uint64_t send_wait_ns;
+	/** How many times a receiver waited for messages. */
+	uint64_t recv_wait_count;
+	/** Total time of the receivers waiting for messages. */
+	uint64_t recv_wait_ns;
+	/** Coroutines woken up by the channel. */
+	uint64_t wakeup_count;
+};
+
+/**
+ * Get the counters of a channel. They are reset on open. The waits
+ * of broadcasts and selects are not counted.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats);
+
+/** Print all the channels of the bus with their counters. */
+void
+coro_bus_dump(struct coro_bus *bus, FILE *out);
+
+/** Events of a channel to wait for in coro_bus_select(). */
+enum {
+	CORO_BUS_SELECT_RECV = 1,
+	CORO_BUS_SELECT_SEND = 2,
+};
+
+struct coro_bus_select_item {
+	/** Descriptor of the channel. */
+	int channel;
+	/** Events to wait for, CORO_BUS_SELECT_*. */
+	int events;
+	/** Ready events, set by coro_bus_select(). */
+	int ready;
+};
+
+/**
+ * Wait until any of the channels is ready for its events, or
+ * @a timeout_ns nanoseconds pass. UINT64_MAX means no timeout, 0
+ * means only a check. The select waits in all the channels at once
+ * and doesn't take any messages, a ready channel is to be used by
+ * the normal calls. Another coroutine can still get there first, so
+ * those are better to be non-blocking. A channel which is gone is
+ * reported as ready, so the next call on it gets the error.
+ * @param bus Bus where the channels are located.
+ * @param items Channels and their events. The ready events are
+ *     set for all of them.
+ * @param count Size of @a items.
+ * @param timeout_ns Timeout in nanoseconds.
+ *
+ * @retval >=0 Index of the first ready item.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - @a count is 0.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the timeout has expired.
+ */
+int
+coro_bus_select(struct coro_bus *bus, struct coro_bus_select_item *items,
+	unsigned count, uint64_t timeout_ns);
+
+/**
+ * A channel which can be used by the coroutines of many threads at
+ * once: of different engines or of a worker pool. The bus and its
+ * channels belong to one thread, so this one is a standalone object
+ * instead. The messages go through a lock-free ring, a lock is
+ * taken only to suspend or to wake up a coroutine.
+ *
+ * A woken coroutine tries again and can lose the message or the
+ * space to a newcomer, so the order of the waiters is not strict.
+ * The calls are to be done only from the coroutines.
+ */
+struct coro_bus_mpmc;
+
+/**
+ * Create a channel for messages of @a elem_size bytes. Its capacity
+ * is @a size_limit rounded up to a power of 2, at least 2.
+ */
+struct coro_bus_mpmc *
+coro_bus_mpmc_new(size_t size_limit, size_t elem_size);
+
+/** Delete the channel. Nobody can use it or wait in it anymore. */
+void
+coro_bus_mpmc_delete(struct coro_bus_mpmc *mpmc);
+
+/**
+ * Send a message to the channel, waiting for space if needed.
+ * @retval 0 Success.
+ */
+int
+coro_bus_mpmc_send(struct coro_bus_mpmc *mpmc, const void *data);
+
+/**
+ * Same as send, but without waiting.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_mpmc_try_send(struct coro_bus_mpmc *mpmc, const void *data);
+
+/**
+ * Receive a message from the channel, waiting for one if needed.
+ * @retval 0 Success.
+ */
+int
+coro_bus_mpmc_recv(struct coro_bus_mpmc *mpmc, void *data);
+
+/**
+ * Same as recv, but without waiting.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_bus_mpmc_try_recv(struct coro_bus_mpmc *mpmc, void *data);
 
 #if NEED_BROADCAST /* Bonus 1 */
 
 /**
  * Send the given message to all the registered channels at once.
+ * Only the channels of unsigned are used, the channels of other
+ * messages are skipped. While waiting, the broadcast reserves a slot
+ * in each full channel as soon as it has space, and is woken up once
+ * all the channels are reserved. The channels are the ones at the
+ * start of the wait, the closed ones are skipped.
  * If any of the channels are full, then the message isn't sent
  * anywhere, and the coroutine is suspended until can submit the
  * data to all the channels.
@@ -158,6 +393,18 @@ coro_bus_broadcast(struct coro_bus *bus, unsigned data);
 int
 coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
 
+/**
+ * Same as coro_bus_broadcast(), but sends a shared message to all
+ * the shared channels. Each channel gets a reference, not a copy.
+ * The caller keeps its own reference.
+ */
+int
+coro_bus_broadcast_shared(struct coro_bus *bus, struct coro_bus_msg *msg);
+
+/** Same as coro_bus_try_broadcast() for a shared message. */
+int
+coro_bus_try_broadcast_shared(struct coro_bus *bus, struct coro_bus_msg *msg);
+
 #endif /* Bonus 1 */
 
 #if NEED_BATCH /* Bonus 2 */
@@ -245,3 +492,88 @@ coro_bus_try_recv_v(struct coro_bus *bus, int channel,
 	unsigned *data, unsigned capacity);
 
 #endif /* Bonus 2 */
+
+#ifdef __cplusplus
+
+#include <type_traits>
+
+/**
+ * Typed access to a channel of messages of type T. It is only a
+ * handle, the channel is opened and closed explicitly. The messages
+ * are stored inline in the channel, no allocations per message.
+ */
+template <typename T>
+struct coro_bus_typed_channel {
+	static_assert(std::is_trivially_copyable<T>::value,
+		"messages are copied bytewise");
+
+	struct coro_bus *bus;
+	int channel;
+
+	/** Open a new channel for T in the bus. */
+	static coro_bus_typed_channel
+	open(struct coro_bus *bus, size_t size_limit)
+	{
+		return {bus, coro_bus_channel_open_sized(bus, size_limit,
+			sizeof(T))};
+	}
+
+	void
+	close()
+	{
+		coro_bus_channel_close(bus, channel);
+	}
+
+	int
+	send(const T &data)
+	{
+		return send_v(&data, 1) < 0 ? -1 : 0;
+	}
+
+	int
+	try_send(const T &data)
+	{
+		return try_send_v(&data, 1) < 0 ? -1 : 0;
+	}
+
+	int
+	recv(T *data)
+	{
+		return recv_v(data, 1) < 0 ? -1 : 0;
+	}
+
+	int
+	try_recv(T *data)
+	{
+		return try_recv_v(data, 1) < 0 ? -1 : 0;
+	}
+
+	int
+	send_v(const T *data, unsigned count)
+	{
+		return coro_bus_send_raw(bus, channel, data, sizeof(T), count);
+	}
+
+	int
+	try_send_v(const T *data, unsigned count)
+	{
+		return coro_bus_try_send_raw(bus, channel, data, sizeof(T),
+			count);
+	}
+
+	int
+	recv_v(T *data, unsigned capacity)
+	{
+		return coro_bus_recv_raw(bus, channel, data, sizeof(T),
+			capacity);
+	}
+
+	int
+	try_recv_v(T *data, unsigned capacity)
+	{
+		return coro_bus_try_recv_raw(bus, channel, data, sizeof(T),
+			capacity);
+	}
+};
+
+#endif /* __cplusplus */
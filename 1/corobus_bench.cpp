@@ -0,0 +1,233 @@
+#include "libcoro.h"
+#include "corobus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+/*
+ * Throughput and latency benchmarks of the bus channels. Each
+ * scenario sends a number of messages from some senders to some
+ * receivers and prints one CSV line: the delivered messages per
+ * second and the percentiles of the time from a send call to the
+ * receipt, waiting for space included.
+ *
+ * A message is an index in the table of the send timestamps, so
+ * the latency is measured via the normal unsigned API.
+ *
+ * Usage: corobus_bench [msg_count]
+ */
+
+static const unsigned size_limits[] = {1, 8, 64, 1024};
+static const unsigned batch_sizes[] = {1, 4, 16, 64, 256, 1024};
+
+static unsigned msg_count = 100 * 1000;
+
+static uint64_t
+bench_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** State of one run, shared by all its coroutines. */
+struct bench_run {
+	struct coro_bus *bus;
+	/** Channels. One, or one per receiver for a broadcast. */
+	std::vector<int> channels;
+	unsigned batch;
+	bool is_broadcast;
+	/** Send time of each message. */
+	std::vector<uint64_t> send_ns;
+	/** Messages delivered to all the receivers. */
+	size_t received;
+	/** Messages to deliver to all the receivers. */
+	size_t received_max;
+	/** Latencies of all the delivered messages. */
+	std::vector<uint64_t> latencies;
+};
+
+struct bench_peer {
+	struct bench_run *run;
+	/** First message index of a sender, or channel of a receiver. */
+	unsigned first;
+	/**
+	 * Number of the messages to send, or to receive by a broadcast
+	 * receiver. The others share the total.
+	 */
+	unsigned count;
+};
+
+static void *
+bench_send_f(void *arg)
+{
+	struct bench_peer *peer = (struct bench_peer *)arg;
+	struct bench_run *run = peer->run;
+	std::vector<unsigned> data(run->batch);
+	unsigned end = peer->first + peer->count;
+	for (unsigned next = peer->first; next < end;) {
+		unsigned count = std::min(run->batch, end - next);
+		uint64_t now = bench_clock_ns();
+		for (unsigned i = 0; i < count; ++i) {
+			data[i] = next + i;
+			run->send_ns[next + i] = now;
+		}
+		if (run->is_broadcast) {
+			if (coro_bus_broadcast(run->bus, data[0]) != 0)
+				abort();
+		} else {
+			unsigned sent = 0;
+			while (sent < count) {
+				int rc = coro_bus_send_v(run->bus,
+					run->channels[0], &data[sent],
+					count - sent);
+				if (rc <= 0)
+					abort();
+				sent += rc;
+			}
+		}
+		next += count;
+	}
+	return NULL;
+}
+
+static void *
+bench_recv_f(void *arg)
+{
+	struct bench_peer *peer = (struct bench_peer *)arg;
+	struct bench_run *run = peer->run;
+	int channel = run->channels[peer->first];
+	std::vector<unsigned> data(run->batch);
+	while (run->is_broadcast ? peer->count > 0 :
+	       run->received < run->received_max) {
+		int rc = coro_bus_recv_v(run->bus, channel, data.data(),
+			run->batch);
+		/* Closed by the receiver which got the last message. */
+		if (rc < 0)
+			break;
+		uint64_t now = bench_clock_ns();
+		for (int i = 0; i < rc; ++i)
+			run->latencies.push_back(now - run->send_ns[data[i]]);
+		run->received += rc;
+		if (run->is_broadcast)
+			peer->count -= rc;
+	}
+	if (!run->is_broadcast && run->received == run->received_max &&
+	    run->channels[0] >= 0) {
+		/* Release the receivers still waiting for more. */
+		coro_bus_channel_close(run->bus, run->channels[0]);
+		run->channels[0] = -1;
+	}
+	return NULL;
+}
+
+static uint64_t
+bench_percentile(const std::vector<uint64_t> &sorted, unsigned permille)
+{
+	if (sorted.empty())
+		return 0;
+	size_t i = sorted.size() * permille / 1000;
+	if (i >= sorted.size())
+		i = sorted.size() - 1;
+	return sorted[i];
+}
+
+static void
+bench_run(const char *name, unsigned sender_count, unsigned receiver_count,
+	unsigned size_limit, unsigned batch, bool is_broadcast)
+{
+	struct bench_run run;
+	run.bus = coro_bus_new();
+	unsigned channel_count = is_broadcast ? receiver_count : 1;
+	for (unsigned i = 0; i < channel_count; ++i)
+		run.channels.push_back(coro_bus_channel_open(run.bus,
+			size_limit));
+	run.batch = is_broadcast ? 1 : batch;
+	run.is_broadcast = is_broadcast;
+	unsigned per_sender = msg_count / sender_count;
+	unsigned total = per_sender * sender_count;
+	run.send_ns.resize(total);
+	run.received = 0;
+	run.received_max = is_broadcast ? (size_t)total * receiver_count :
+		total;
+	run.latencies.reserve(run.received_max);
+
+	std::vector<struct bench_peer> peers(sender_count + receiver_count);
+	std::vector<struct coro *> coros;
+	uint64_t start = bench_clock_ns();
+	for (unsigned i = 0; i < receiver_count; ++i) {
+		struct bench_peer *peer = &peers[sender_count + i];
+		peer->run = &run;
+		peer->first = is_broadcast ? i : 0;
+		peer->count = is_broadcast ? total : 0;
+		coros.push_back(coro_new(bench_recv_f, peer));
+	}
+	for (unsigned i = 0; i < sender_count; ++i) {
+		struct bench_peer *peer = &peers[i];
+		peer->run = &run;
+		peer->first = i * per_sender;
+		peer->count = per_sender;
+		coros.push_back(coro_new(bench_send_f, peer));
+	}
+	for (struct coro *c : coros)
+		coro_join(c);
+	uint64_t duration = bench_clock_ns() - start;
+
+	for (int channel : run.channels) {
+		if (channel >= 0)
+			coro_bus_channel_close(run.bus, channel);
+	}
+	coro_bus_delete(run.bus);
+	std::sort(run.latencies.begin(), run.latencies.end());
+	printf("%s,%u,%u,%u,%u,%zu,%.0f,%llu,%llu,%llu,%llu\n", name,
+		sender_count, receiver_count, size_limit, run.batch,
+		run.received, run.received * 1e9 / duration,
+		(unsigned long long)bench_percentile(run.latencies, 500),
+		(unsigned long long)bench_percentile(run.latencies, 990),
+		(unsigned long long)bench_percentile(run.latencies, 999),
+		(unsigned long long)bench_percentile(run.latencies, 1000));
+	fflush(stdout);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	printf("scenario,senders,receivers,size_limit,batch,msgs,"
+		"msgs_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n");
+	for (unsigned size_limit : size_limits) {
+		bench_run("1:1", 1, 1, size_limit, 1, false);
+		bench_run("N:1", 4, 1, size_limit, 1, false);
+		bench_run("1:N", 1, 4, size_limit, 1, false);
+		bench_run("N:M", 4, 4, size_limit, 1, false);
+		bench_run("broadcast", 1, 4, size_limit, 1, true);
+		for (unsigned batch : batch_sizes)
+			bench_run("batch", 1, 1, size_limit, batch, false);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1) {
+		int count = atoi(argv[1]);
+		if (count <= 0) {
+			printf("Usage: %s [msg_count]\n", argv[0]);
+			return -1;
+		}
+		msg_count = count;
+	}
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
@@ -11,41 +11,220 @@
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * The coroutines can switch either via a hand-written assembly
+ * routine, which saves only the callee-saved registers and the
+ * stack pointer, or via the portable but slow signal-based
+ * machinery (sigaltstack + sigsetjmp/siglongjmp). The latter is
+ * used on the architectures without the assembly routine, or when
+ * explicitly requested at build time.
+ */
+#ifndef LIBCORO_SIGNAL_SWITCH
+#if defined(__x86_64__) || defined(__aarch64__)
+#define LIBCORO_SIGNAL_SWITCH 0
+#else
+#define LIBCORO_SIGNAL_SWITCH 1
+#endif
+#endif
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
 	exit(-1);																	\
 } while(0)
 
+enum {
+	/** Stack size of the coroutines created via coro_new(). */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/**
+	 * Stack sizes are rounded up to a power of two, so as the
+	 * pooled coroutines could be reused for any size hint not
+	 * bigger than theirs in O(1). The smallest class is 16KB.
+	 */
+	CORO_STACK_CLASS_MIN_LOG = 14,
+	/** The biggest class is 512MB. */
+	CORO_STACK_CLASS_COUNT = 16,
+	/** Default pool limits, see coro_sched_pool_config(). */
+	CORO_POOL_HOT_COUNT_DEFAULT = 64,
+	CORO_POOL_MAX_COUNT_DEFAULT = 1024,
+	CORO_POOL_KEEP_SIZE_DEFAULT = 16 * 1024,
+	/**
+	 * The timers are kept in a hierarchical wheel. A tick is
+	 * 2^16 ns, ~65us. Each level has 64 slots, each slot of a
+	 * level covers 64 slots of the previous level. 4 levels
+	 * cover ~18 minutes. The further timers are parked in the
+	 * last level and re-inserted when it comes to them.
+	 */
+	CORO_TIMER_TICK_LOG = 16,
+	CORO_TIMER_SLOT_LOG = 6,
+	CORO_TIMER_SLOT_COUNT = 1 << CORO_TIMER_SLOT_LOG,
+	CORO_TIMER_LEVEL_COUNT = 4,
+	/** How many I/O events are taken per one epoll_wait(). */
+	CORO_POLL_BATCH = 64,
+};
+
 enum coro_state {
 	CORO_STATE_RUNNING,
 	CORO_STATE_SUSPENDED,
 	CORO_STATE_FINISHED,
+	/*
+	 * The states below are used only by the worker pool. There
+	 * the state is changed atomically, because the wakeups can
+	 * come from other threads.
+	 */
+	/**
+	 * Running, but a wakeup has come. The next suspension
+	 * returns right away.
+	 */
+	CORO_STATE_NOTIFIED,
+	/**
+	 * Suspended, but still didn't leave its stack. Its worker
+	 * makes it SUSPENDED, when gets the control back.
+	 */
+	CORO_STATE_PARKING,
+};
+
+/** Cancellation progress of a coroutine. */
+enum coro_cancel_state {
+	CORO_CANCEL_NONE,
+	/** Cancelled, but the coroutine didn't notice yet. */
+	CORO_CANCEL_PENDING,
+	/** A suspension has returned because of the cancellation. */
+	CORO_CANCEL_DELIVERED,
+};
+
+struct coro_worker;
+
+/**
+ * A coroutine-local value. It is valid only while the key has the
+ * same generation, so a deleted key loses all its values at once,
+ * even the ones in the other threads.
+ */
+struct coro_specific {
+	void *value;
+	/** Generation of the key when the value was set. */
+	unsigned generation;
 };
 
 /** Main coroutine structure, its context. */
 struct coro {
 	/** Coroutine state. */
 	enum coro_state state;
+	/** Run queue the coroutine goes to when becomes runnable. */
+	enum coro_prio prio;
 	/** A value, returned by func. */
 	void *ret;
 	/** Stack, used by the coroutine. */
 	uint8_t *stack;
+	/** Usable stack size, without the guard page. */
+	size_t stack_size;
+	/** Stack size class, index of the pool to return to. */
+	int stack_class;
+	/**
+	 * Stack high-water mark - how many bytes from the stack top
+	 * have ever been touched, as of the last recycle.
+	 */
+	size_t stack_hwm;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+#if LIBCORO_SIGNAL_SWITCH
 	/** Last remembered coroutine context. */
 	sigjmp_buf ctx;
+#else
+	/**
+	 * Stack pointer of the coroutine saved at the last switch
+	 * out of it. The callee-saved registers are on the stack.
+	 */
+	void *ctx;
+#endif
 	/**
 	 * Coroutine which is trying to join this one right now.
 	 */
 	struct coro *joiner;
+	/**
+	 * Engine which has created the coroutine. In a worker pool
+	 * the coroutine can run in any engine of the pool.
+	 */
+	struct coro_engine *engine;
+	/** Scheduling counters, collected when enabled. */
+	struct coro_stats stats;
+	/** When the coroutine became runnable last time. */
+	uint64_t ready_ns;
+	/** When the coroutine got the CPU last time. */
+	uint64_t run_start_ns;
+	/** Cancellation progress. Changed atomically. */
+	enum coro_cancel_state cancel_state;
+	/** Group the coroutine is a member of, if any. */
+	struct coro_group *group;
+	/** Coroutine-local values, indexed by the keys. */
+	struct coro_specific specific[CORO_KEY_COUNT];
 	/** Links in a coroutine list, used by the scheduler. */
 	struct rlist link;
+	/** Link in the list of all the coroutines of the engine. */
+	struct rlist in_engine;
+	/** Link in the members list of the group. */
+	struct rlist in_group;
+};
+
+/**
+ * Group of coroutines. The members are linked into it via their
+ * own objects, so the group doesn't allocate per member.
+ */
+struct coro_group {
+	/** Members can finish in other workers of a pool. */
+	pthread_mutex_t mutex;
+	/** The members which are still running. */
+	struct rlist members;
+	/** Finished members not taken out yet. */
+	struct rlist finished;
+	/** Coroutine waiting for a member to finish. */
+	struct coro *waiter;
+	/** The group is cancelled, so are its new members. */
+	bool is_cancelled;
+};
+
+/** A recorded run of a coroutine. */
+struct coro_trace_event {
+	struct coro *coro;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+/**
+ * A timer waking a coroutine up. Lives on the stack of the
+ * sleeping coroutine.
+ */
+struct coro_timer {
+	/** Tick, at which the timer expires. */
+	uint64_t deadline;
+	/** Coroutine to wake up. */
+	struct coro *coro;
+	/** Engine, which wheel the timer is in. */
+	struct coro_engine *engine;
+	/** Wheel level and slot the timer is in. */
+	int level;
+	int slot;
+	/** The timer has expired and is not in the wheel anymore. */
+	bool is_fired;
+	/** Link in a wheel slot. */
+	struct rlist link;
 };
 
 struct coro_engine {
+	/**
+	 * Worker of the pool, running this engine. NULL if the
+	 * engine is not a part of a worker pool.
+	 */
+	struct coro_worker *worker;
 	/**
 	 * Scheduler is the main coroutine - it represents the
 	 * context in which the scheduler itself runs.
@@ -55,205 +234,1903 @@ struct coro_engine {
 	struct coro *this_coro;
 
 	/**
-	 * Coroutines to run in this iteration of the loop. The
-	 * list gets populated once at the start of the iteration.
+	 * Runnable coroutines, a queue per priority. They get
+	 * populated by wakeups and yields and new coros.
 	 */
-	struct rlist coros_running_now;
+	struct rlist run_queue[CORO_PRIO_COUNT];
+	/** Number of coroutines in the run queues. */
+	size_t run_count;
 	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
+	 * How much each non-empty run queue is owed, for the
+	 * weighted dispatch.
 	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
-	struct rlist coros_pool;
+	int run_credit[CORO_PRIO_COUNT];
+	/**
+	 * Switches left in this iteration of the loop. Then the
+	 * scheduler gets the control back to look for the timers
+	 * and I/O.
+	 */
+	size_t round_left;
+	/**
+	 * Joined coroutines to be reused, one list per stack size
+	 * class.
+	 */
+	struct rlist coros_pool[CORO_STACK_CLASS_COUNT];
+	/**
+	 * Joined coroutines of a worker engine, which were freed
+	 * but the object itself. A late wakeup still can touch it,
+	 * so it is only reused with a new stack.
+	 */
+	struct rlist coros_stackless;
 	/** Total number of coroutines, including the pool. */
 	size_t coro_count;
+	/**
+	 * Joined coroutines beyond this count get their stacks
+	 * trimmed before going to the pool.
+	 */
+	size_t pool_hot_count;
+	/** Joined coroutines beyond this count are freed. */
+	size_t pool_max_count;
+	/** Stack top size left committed after a trim. */
+	size_t pool_keep_size;
+	/** Pool usage counters. */
+	struct coro_pool_stats pool_stats;
+	/** Timer wheel, a list of timers per slot of each level. */
+	struct rlist timers[CORO_TIMER_LEVEL_COUNT][CORO_TIMER_SLOT_COUNT];
+	/** Bit per non-empty slot, for each level. */
+	uint64_t timer_slot_mask[CORO_TIMER_LEVEL_COUNT];
+	/** The next tick to process. All before it are expired. */
+	uint64_t timer_tick;
+	/** Number of timers in the wheel. */
+	size_t timer_count;
+	/** Epoll instance for the I/O waits, created on demand. */
+	int epoll_fd;
+	/** Number of coroutines waiting for descriptors. */
+	size_t io_wait_count;
+	/**
+	 * Descriptors registered in the epoll, indexed by the number.
+	 * NULL for the ones nobody waits for.
+	 */
+	struct coro_fd **fds;
+	/** Capacity of the descriptor table. */
+	int fd_capacity;
+	/**
+	 * Wakeups from other threads, a lock-free stack. The engine
+	 * takes it whole at each iteration.
+	 */
+	struct coro_remote *inbox;
+	/** Remote wakeups expected. The engine waits for them. */
+	size_t remote_count;
+	/** Eventfd in the epoll, to wake up the sleeping engine. */
+	int event_fd;
+	/** The engine sleeps or is about to, needs a poke. */
+	bool is_sleeping;
+	/**
+	 * Protects the timers and the I/O waits of a worker engine.
+	 * They can be cancelled from other workers, when the
+	 * waiting coroutine migrates.
+	 */
+	pthread_mutex_t mutex;
+	/** All the coroutines created by the engine, for the dump. */
+	struct rlist coros_all;
+	/** The scheduling counters are collected. */
+	bool is_stats_enabled;
+	/** Switches to the coroutines while the counters were on. */
+	uint64_t switch_count;
+	/** Ring of the recorded runs. NULL if not recording. */
+	struct coro_trace_event *trace;
+	size_t trace_size;
+	/** Total runs recorded. The ring keeps the last ones. */
+	size_t trace_count;
+	/** When the recording has started. */
+	uint64_t trace_start_ns;
+#if LIBCORO_SIGNAL_SWITCH
 	/**
 	 * Buffer, used by the coroutine constructor to escape
 	 * from the signal handler back into the constructor to
 	 * rollback sigaltstack etc.
 	 */
 	sigjmp_buf start_point;
+#endif
+};
+
+#if !LIBCORO_SIGNAL_SWITCH
+
+/**
+ * Save the callee-saved registers on the current stack, store the
+ * stack pointer into @a from_sp, switch to the stack @a to_sp and
+ * restore the registers saved there. The caller-saved registers
+ * are already spilled by the compiler around the call.
+ */
+extern "C" void
+coro_ctx_switch(void **from_sp, void *to_sp);
+
+/**
+ * The first "return address" of a new coroutine. Calls the entry
+ * function with the coroutine as the argument, both taken from the
+ * callee-saved registers of the initial frame.
+ */
+extern "C" void
+coro_ctx_start(void);
+
+#if defined(__x86_64__)
+
+/*
+ * Frame layout from the saved stack pointer: r15, r14, r13, r12,
+ * rbx, rbp, return address.
+ */
+enum {
+	CORO_CTX_SLOT_FUNC = 1,
+	CORO_CTX_SLOT_CORO = 3,
+	CORO_CTX_SLOT_RET = 6,
+	CORO_CTX_SLOT_COUNT = 7,
+};
+
+asm(
+"	.text\n"
+"	.globl coro_ctx_switch\n"
+"	.hidden coro_ctx_switch\n"
+"	.type coro_ctx_switch, @function\n"
+"coro_ctx_switch:\n"
+"	pushq %rbp\n"
+"	pushq %rbx\n"
+"	pushq %r12\n"
+"	pushq %r13\n"
+"	pushq %r14\n"
+"	pushq %r15\n"
+"	movq %rsp, (%rdi)\n"
+"	movq %rsi, %rsp\n"
+"	popq %r15\n"
+"	popq %r14\n"
+"	popq %r13\n"
+"	popq %r12\n"
+"	popq %rbx\n"
+"	popq %rbp\n"
+"	ret\n"
+"	.size coro_ctx_switch, .-coro_ctx_switch\n"
+"\n"
+"	.globl coro_ctx_start\n"
+"	.hidden coro_ctx_start\n"
+"	.type coro_ctx_start, @function\n"
+"coro_ctx_start:\n"
+"	movq %r12, %rdi\n"
+"	callq *%r14\n"
+"	ud2\n"
+"	.size coro_ctx_start, .-coro_ctx_start\n"
+);
+
+#elif defined(__aarch64__)
+
+/*
+ * Frame layout from the saved stack pointer: x19-x30, d8-d15. The
+ * return address is x30.
+ */
+enum {
+	CORO_CTX_SLOT_CORO = 0,
+	CORO_CTX_SLOT_FUNC = 2,
+	CORO_CTX_SLOT_RET = 11,
+	CORO_CTX_SLOT_COUNT = 20,
 };
 
+asm(
+"	.text\n"
+"	.globl coro_ctx_switch\n"
+"	.hidden coro_ctx_switch\n"
+"	.type coro_ctx_switch, %function\n"
+"coro_ctx_switch:\n"
+"	sub sp, sp, #160\n"
+"	stp x19, x20, [sp, #0]\n"
+"	stp x21, x22, [sp, #16]\n"
+"	stp x23, x24, [sp, #32]\n"
+"	stp x25, x26, [sp, #48]\n"
+"	stp x27, x28, [sp, #64]\n"
+"	stp x29, x30, [sp, #80]\n"
+"	stp d8, d9, [sp, #96]\n"
+"	stp d10, d11, [sp, #112]\n"
+"	stp d12, d13, [sp, #128]\n"
+"	stp d14, d15, [sp, #144]\n"
+"	mov x9, sp\n"
+"	str x9, [x0]\n"
+"	mov sp, x1\n"
+"	ldp x19, x20, [sp, #0]\n"
+"	ldp x21, x22, [sp, #16]\n"
+"	ldp x23, x24, [sp, #32]\n"
+"	ldp x25, x26, [sp, #48]\n"
+"	ldp x27, x28, [sp, #64]\n"
+"	ldp x29, x30, [sp, #80]\n"
+"	ldp d8, d9, [sp, #96]\n"
+"	ldp d10, d11, [sp, #112]\n"
+"	ldp d12, d13, [sp, #128]\n"
+"	ldp d14, d15, [sp, #144]\n"
+"	add sp, sp, #160\n"
+"	ret\n"
+"	.size coro_ctx_switch, .-coro_ctx_switch\n"
+"\n"
+"	.globl coro_ctx_start\n"
+"	.hidden coro_ctx_start\n"
+"	.type coro_ctx_start, %function\n"
+"coro_ctx_start:\n"
+"	mov x0, x19\n"
+"	blr x21\n"
+"	brk #0\n"
+"	.size coro_ctx_start, .-coro_ctx_start\n"
+);
+
+#endif
+
+#endif /* !LIBCORO_SIGNAL_SWITCH */
+
+/**
+ * Remember the context of @a from and continue execution of @a to
+ * from its last remembered context. Returns when someone switches
+ * back to @a from.
+ */
+static inline void
+coro_switch(struct coro *from, struct coro *to)
+{
+#if LIBCORO_SIGNAL_SWITCH
+	if (sigsetjmp(from->ctx, 0) == 0)
+		siglongjmp(to->ctx, 1);
+#else
+	coro_ctx_switch(&from->ctx, to->ctx);
+#endif
+}
+
+static uint64_t
+coro_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static void
 coro_engine_create(struct coro_engine *engine)
 {
 	memset(engine, 0, sizeof(*engine));
 	rlist_create(&engine->sched.link);
-	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	engine->sched.engine = engine;
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+		rlist_create(&engine->run_queue[i]);
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i)
+		rlist_create(&engine->coros_pool[i]);
+	rlist_create(&engine->coros_stackless);
+	engine->pool_hot_count = CORO_POOL_HOT_COUNT_DEFAULT;
+	engine->pool_max_count = CORO_POOL_MAX_COUNT_DEFAULT;
+	engine->pool_keep_size = CORO_POOL_KEEP_SIZE_DEFAULT;
+	for (int i = 0; i < CORO_TIMER_LEVEL_COUNT; ++i) {
+		for (int j = 0; j < CORO_TIMER_SLOT_COUNT; ++j)
+			rlist_create(&engine->timers[i][j]);
+	}
+	engine->timer_tick = coro_clock_ns() >> CORO_TIMER_TICK_LOG;
+	engine->epoll_fd = -1;
+	engine->event_fd = -1;
+	pthread_mutex_init(&engine->mutex, NULL);
+	rlist_create(&engine->coros_all);
 }
 
-static void
-coro_engine_resume_next(struct coro_engine *engine)
+static size_t
+coro_page_size(void)
 {
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
-		struct coro, link);
-	struct coro *from = engine->this_coro;
-	assert(from != NULL);
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
 
-	engine->this_coro = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	assert(rlist_empty(&from->link));
-	assert(engine->this_coro == NULL);
-	engine->this_coro = from;
+/**
+ * Find the stack size class fitting the given size hint. 0 means
+ * the default size. Too big hints are truncated to the biggest
+ * class.
+ */
+static int
+coro_stack_class(size_t size)
+{
+	if (size == 0)
+		size = CORO_STACK_SIZE_DEFAULT;
+#if LIBCORO_SIGNAL_SWITCH
+	if (size < (size_t)SIGSTKSZ)
+		size = SIGSTKSZ;
+#endif
+	int cls = 0;
+	while (cls < CORO_STACK_CLASS_COUNT - 1 &&
+	       ((size_t)1 << (cls + CORO_STACK_CLASS_MIN_LOG)) < size)
+		++cls;
+	return cls;
 }
 
-static void
-coro_engine_suspend(struct coro_engine *engine)
+/**
+ * Reserve a stack of the given size. The memory is mapped, but not
+ * committed - the pages are populated by the kernel on first touch,
+ * so a coroutine costs only as much memory as deep it goes. Below
+ * the stack there is a guard page, so an overflow crashes right
+ * away instead of corrupting a neighbour.
+ *
+ * The guard splits the mapping in two, so each stack takes 2 of the
+ * vm.max_map_count mappings of the process. When they run out, the
+ * result is NULL with errno ENOMEM.
+ */
+static uint8_t *
+coro_stack_new(size_t size)
 {
-	struct coro *this_coro = engine->this_coro;
-	if (this_coro == NULL) {
-		printf("Error: deadlock - suspension with no active "
-			"coroutines\n");
-		exit(-1);
+	size_t guard = coro_page_size();
+	assert(size % guard == 0);
+	void *mem = mmap(NULL, size + guard, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+		-1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	if (mprotect(mem, guard, PROT_NONE) != 0) {
+		int err = errno;
+		munmap(mem, size + guard);
+		errno = err;
+		return NULL;
 	}
-	assert(rlist_empty(&this_coro->link));
-	assert(this_coro->state == CORO_STATE_RUNNING);
-	this_coro->state = CORO_STATE_SUSPENDED;
-	coro_engine_resume_next(engine);
+	return (uint8_t *)mem + guard;
 }
 
 static void
-coro_engine_yield(struct coro_engine *engine)
+coro_stack_delete(uint8_t *stack, size_t size)
 {
-	struct coro *this_coro = engine->this_coro;
-	assert(rlist_empty(&this_coro->link));
-	assert(this_coro->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this_coro, link);
-	coro_engine_resume_next(engine);
+	size_t guard = coro_page_size();
+	if (munmap(stack - guard, size + guard) != 0)
+		handle_error();
 }
 
-static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+/**
+ * Update the stack high-water mark of the coroutine: the lowest
+ * stack page committed so far, as told by mincore(). Whatever the
+ * content, a touched page counts as used, so a zeroed buffer or a
+ * sparse frame can't hide the pages below it. Only the pages below
+ * the previous mark are checked, from the bottom up. Neither the
+ * check nor anything else reads the untouched pages, so they stay
+ * not committed.
+ */
+static size_t
+coro_stack_watermark(struct coro *c)
 {
-	if (coro->state == CORO_STATE_RUNNING)
-		return;
-	if (coro->state == CORO_STATE_FINISHED)
-		return;
-	assert(coro->state == CORO_STATE_SUSPENDED);
-	assert(rlist_empty(&coro->link));
-	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	size_t page_size = coro_page_size();
+	uint8_t *top = c->stack + c->stack_size;
+	uintptr_t end = (uintptr_t)(top - c->stack_hwm) &
+		~(uintptr_t)(page_size - 1);
+	unsigned char vec[256];
+	uintptr_t page = (uintptr_t)c->stack;
+	while (page < end) {
+		size_t count = (end - page) / page_size;
+		if (count > sizeof(vec))
+			count = sizeof(vec);
+		if (mincore((void *)page, count * page_size, vec) != 0)
+			handle_error();
+		for (size_t i = 0; i < count; ++i) {
+			if ((vec[i] & 1) != 0) {
+				c->stack_hwm = top - (uint8_t *)page;
+				return c->stack_hwm;
+			}
+			page += page_size;
+		}
+	}
+	return c->stack_hwm;
+}
+
+/**
+ * Release the committed stack pages of the coroutine except for
+ * the top keep_size bytes. The released pages are not committed
+ * anymore, so the watermark goes down to what is kept.
+ */
+static bool
+coro_stack_trim(struct coro *c, size_t keep_size)
+{
+	if (c->stack_hwm <= keep_size)
+		return false;
+	size_t page_size = coro_page_size();
+	uint8_t *top = c->stack + c->stack_size;
+	uintptr_t begin = (uintptr_t)(top - c->stack_hwm);
+	begin &= ~(uintptr_t)(page_size - 1);
+	uintptr_t end = (uintptr_t)(top - keep_size);
+	end &= ~(uintptr_t)(page_size - 1);
+	if (begin >= end)
+		return false;
+	if (madvise((void *)begin, end - begin, MADV_DONTNEED) != 0)
+		handle_error();
+	c->stack_hwm = top - (uint8_t *)end;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////
+// Worker pool core.
+//////////////////////////////////////////////////////////////////
+
+/**
+ * Buffer of a work-stealing deque. The replaced buffers are kept
+ * until the deque is destroyed, because the thieves might still
+ * be reading them.
+ */
+struct coro_deque_buf {
+	int64_t mask;
+	struct coro **data;
+	struct coro_deque_buf *prev;
+};
+
+/**
+ * Chase-Lev work-stealing deque. The owner pushes and takes the
+ * coroutines at the bottom, the other workers steal from the top.
+ */
+struct coro_deque {
+	alignas(64) int64_t top;
+	alignas(64) int64_t bottom;
+	struct coro_deque_buf *buf;
+};
+
+enum {
+	CORO_DEQUE_SIZE_DEFAULT = 256,
+};
+
+/** What to do with a coroutine which switched to the scheduler. */
+enum coro_worker_action {
+	CORO_WORKER_YIELD,
+	CORO_WORKER_PARK,
+	CORO_WORKER_FINISH,
+};
+
+struct coro_worker_pool;
+
+/** One thread of the worker pool. */
+struct coro_worker {
+	/**
+	 * Engine of the worker. Its scheduler context is where the
+	 * coroutines return after each step, its list of the next
+	 * coroutines gets the ones woken up by this worker, and its
+	 * pool gets the coroutines joined by this worker.
+	 */
+	struct coro_engine *engine;
+	/** The pool this worker belongs to. */
+	struct coro_worker_pool *pool;
+	/** Runnable coroutines, available for stealing. */
+	struct coro_deque deque;
+	/** Action requested by the last coroutine switched out. */
+	enum coro_worker_action action;
+	/** State of the pseudo-random victim selection. */
+	unsigned rand;
+	/** The thread running the worker. */
+	pthread_t thread;
+};
+
+struct coro_worker_pool {
+	/** Workers. The first one runs in the coro_sched_run() caller. */
+	struct coro_worker *workers;
+	int worker_count;
+	/**
+	 * Coroutines woken up by the threads not belonging to the
+	 * pool. Protected by the mutex.
+	 */
+	struct rlist inject;
+	/** Size of the inject list, readable without the mutex. */
+	size_t inject_count;
+	/** Number of the workers waiting for work. */
+	int idle_count;
+	/**
+	 * Number of not finished coroutines. The run is over when
+	 * there are none, because a suspended one still can be
+	 * woken up by a foreign thread.
+	 */
+	size_t active_count;
+	/** All the workers are done - the run is over. */
+	bool is_done;
+	/** Total number of coroutines in all the worker engines. */
+	size_t coro_count;
+	pthread_mutex_t mutex;
+};
+
+static struct coro_deque_buf *
+coro_deque_buf_new(int64_t size, struct coro_deque_buf *prev)
+{
+	struct coro_deque_buf *buf = new coro_deque_buf();
+	buf->mask = size - 1;
+	buf->data = new struct coro *[size];
+	buf->prev = prev;
+	return buf;
 }
 
 static void
-coro_engine_run(struct coro_engine *engine)
+coro_deque_create(struct coro_deque *deque)
 {
-	while (true) {
-		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->buf = coro_deque_buf_new(CORO_DEQUE_SIZE_DEFAULT, NULL);
+}
 
-		assert(engine->this_coro == NULL);
-		engine->this_coro = &engine->sched;
-		assert(rlist_empty(&engine->sched.link));
-		/*
-		 * Add the scheduler to the tail so the control
-		 * comes back in the end of this iteration of the
-		 * loop.
-		 */
-		rlist_add_tail_entry(&engine->coros_running_now,
-			&engine->sched, link);
-		coro_engine_resume_next(engine);
-		assert(rlist_empty(&engine->coros_running_now));
-		assert(engine->this_coro == &engine->sched);
-		engine->this_coro = NULL;
+static void
+coro_deque_destroy(struct coro_deque *deque)
+{
+	assert(deque->top == deque->bottom);
+	struct coro_deque_buf *buf = deque->buf;
+	while (buf != NULL) {
+		struct coro_deque_buf *prev = buf->prev;
+		delete[] buf->data;
+		delete buf;
+		buf = prev;
 	}
 }
 
+/** Push a coroutine to the bottom. Only the owner can do that. */
 static void
-coro_engine_destroy(struct coro_engine *engine)
+coro_deque_push(struct coro_deque *deque, struct coro *c)
 {
-	assert(engine->this_coro == NULL);
-	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		delete[] c->stack;
-		delete c;
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
+	int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	struct coro_deque_buf *buf = deque->buf;
+	if (b - t > buf->mask) {
+		struct coro_deque_buf *new_buf =
+			coro_deque_buf_new(2 * (buf->mask + 1), buf);
+		for (int64_t i = t; i < b; ++i) {
+			new_buf->data[i & new_buf->mask] = __atomic_load_n(
+				&buf->data[i & buf->mask], __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&deque->buf, new_buf, __ATOMIC_RELEASE);
+		buf = new_buf;
 	}
-	assert(engine->coro_count == 0);
-	memset(engine, '#', sizeof(*engine));
+	__atomic_store_n(&buf->data[b & buf->mask], c, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
 }
 
-static __thread struct coro_engine *new_coro_engine = NULL;
+/** Take a coroutine from the bottom. Only the owner can do that. */
+static struct coro *
+coro_deque_take(struct coro_deque *deque)
+{
+	int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	struct coro_deque_buf *buf = deque->buf;
+	__atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	struct coro *c = __atomic_load_n(&buf->data[b & buf->mask],
+		__ATOMIC_RELAXED);
+	if (t == b) {
+		/* The last one, race with the thieves. */
+		if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			c = NULL;
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return c;
+}
 
 /**
- * The core part of the coroutines creation - this signal handler
- * runs on a separate stack using sigaltstack. At invocation it
- * remembers its current context and jumps back to the coroutine
- * constructor. Later the coroutine continues from here.
+ * Steal a coroutine from the top. Can be done by any thread. NULL
+ * is returned when the deque is empty or another thief won.
+ */
+static struct coro *
+coro_deque_steal(struct coro_deque *deque)
+{
+	int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	struct coro_deque_buf *buf = __atomic_load_n(&deque->buf,
+		__ATOMIC_ACQUIRE);
+	struct coro *c = __atomic_load_n(&buf->data[t & buf->mask],
+		__ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return c;
+}
+
+/**
+ * Engine of this thread. Each thread has own engine, so the
+ * independent schedulers don't share anything.
  */
+static __thread struct coro_engine *cur_coro_engine = NULL;
+
+/**
+ * Engine of the current thread. The function is not inlined on
+ * purpose - a coroutine can be continued by another worker, so the
+ * thread-local pointer must be re-read after each switch.
+ */
+static __attribute__((noinline)) struct coro_engine *
+coro_engine_cur(void)
+{
+	struct coro_engine *engine = cur_coro_engine;
+	assert(engine != NULL);
+	return engine;
+}
+
+/** Make the coroutine runnable in this engine. */
+static inline void
+coro_engine_push(struct coro_engine *engine, struct coro *c)
+{
+	enum coro_prio prio = __atomic_load_n(&c->prio, __ATOMIC_RELAXED);
+	rlist_add_tail_entry(&engine->run_queue[prio], c, link);
+	++engine->run_count;
+	if (engine->is_stats_enabled)
+		c->ready_ns = coro_clock_ns();
+}
+
+/** Wake up the engine sleeping in epoll_wait(), from any thread. */
 static void
-coro_body(int signum)
+coro_engine_poke(struct coro_engine *engine)
 {
-	(void)signum;
-	struct coro_engine *my_engine = new_coro_engine;
-	new_coro_engine = NULL;
+	uint64_t value = 1;
+	if (write(engine->event_fd, &value, sizeof(value)) < 0)
+		assert(errno == EAGAIN);
+}
 
-	struct coro *c = my_engine->this_coro;
-	my_engine->this_coro = NULL;
-	/*
-	 * On invocation jump back to the constructor right after
-	 * remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(my_engine->start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finally start work.
-	 */
-	my_engine->this_coro = c;
-	while (true) {
-		c->ret = c->func(c->func_arg);
-		c->func = NULL;
-		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
-		/*
-		 * Here it is restarted already, must have its
-		 * state restored.
-		 */
-		assert(c->state == CORO_STATE_RUNNING);
-		assert(c->func != NULL);
+/**
+ * Wake up one of the sleeping workers, if any, to look for work.
+ * The caller has published the work before. A worker going to
+ * sleep either is seen here, or sees the work itself.
+ */
+static void
+coro_worker_pool_notify(struct coro_worker_pool *pool)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->idle_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	for (int i = 0; i < pool->worker_count; ++i) {
+		struct coro_engine *engine = pool->workers[i].engine;
+		bool is_sleeping = true;
+		if (__atomic_compare_exchange_n(&engine->is_sleeping,
+						&is_sleeping, false, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED)) {
+			coro_engine_poke(engine);
+			return;
+		}
 	}
 }
 
-static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+/**
+ * Add the coroutine to the runnable ones. A worker of its pool
+ * takes it into its own list. A foreign thread passes it to the
+ * pool via the inject list.
+ */
+static void
+coro_worker_push(struct coro *c)
 {
-	struct coro *c = new coro();
-	c->state = CORO_STATE_RUNNING;
-	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = new uint8_t[stack_size];
-	c->func = func;
-	c->func_arg = func_arg;
-	c->joiner = NULL;
-	rlist_create(&c->link);
-	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
-	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+	struct coro_worker_pool *pool = c->engine->worker->pool;
+	struct coro_engine *engine = cur_coro_engine;
+	if (engine != NULL && engine->worker != NULL &&
+	    engine->worker->pool == pool) {
+		coro_engine_push(engine, c);
+		return;
+	}
+	pthread_mutex_lock(&pool->mutex);
+	rlist_add_tail_entry(&pool->inject, c, link);
+	__atomic_add_fetch(&pool->inject_count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->mutex);
+	coro_worker_pool_notify(pool);
+}
+
+/**
+ * Give the control back to the worker's scheduler, which is going
+ * to apply the action to the coroutine once it is off its stack.
+ */
+static void
+coro_worker_switch_out(struct coro_engine *engine,
+	enum coro_worker_action action)
+{
+	struct coro *c = engine->this_coro;
+	engine->worker->action = action;
+	engine->this_coro = NULL;
+	coro_switch(c, &engine->sched);
+	/* Might be continued by another worker. */
+	engine = coro_engine_cur();
+	assert(engine->this_coro == NULL);
+	engine->this_coro = c;
+}
+
+static void
+coro_worker_suspend(struct coro_engine *engine)
+{
+	struct coro *c = engine->this_coro;
+	enum coro_state state = CORO_STATE_RUNNING;
+	if (!__atomic_compare_exchange_n(&c->state, &state,
+					 CORO_STATE_PARKING, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		/* Consume the wakeup which came while running. */
+		assert(state == CORO_STATE_NOTIFIED);
+		__atomic_store_n(&c->state, CORO_STATE_RUNNING,
+			__ATOMIC_RELAXED);
+		return;
+	}
+	coro_worker_switch_out(engine, CORO_WORKER_PARK);
+}
+
+/**
+ * Wakeup which can be called from any thread. Unlike the single
+ * threaded engine, a wakeup of a running coroutine is remembered,
+ * so it can't be lost when races with the coroutine going to
+ * sleep.
+ */
+static void
+coro_worker_wakeup(struct coro *c)
+{
+	enum coro_state state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+	enum coro_state new_state;
+	while (true) {
+		switch (state) {
+		case CORO_STATE_SUSPENDED:
+		case CORO_STATE_PARKING:
+			new_state = CORO_STATE_RUNNING;
+			break;
+		case CORO_STATE_RUNNING:
+			new_state = CORO_STATE_NOTIFIED;
+			break;
+		default:
+			return;
+		}
+		if (__atomic_compare_exchange_n(&c->state, &state, new_state,
+						false, __ATOMIC_SEQ_CST,
+						__ATOMIC_ACQUIRE))
+			break;
+	}
+	/*
+	 * A parking coroutine is pushed by its worker, when the
+	 * worker sees the wakeup.
+	 */
+	if (state == CORO_STATE_SUSPENDED)
+		coro_worker_push(c);
+}
+
+/**
+ * Account a created or a freed coroutine. In a worker pool they
+ * migrate between the engines, so are counted for the whole pool.
+ */
+static void
+coro_engine_count_add(struct coro_engine *engine, int delta)
+{
+	size_t *count = &engine->coro_count;
+	if (engine->worker != NULL)
+		count = &engine->worker->pool->coro_count;
+	size_t old = __atomic_fetch_add(count, delta, __ATOMIC_RELAXED);
+	assert(delta > 0 || old > 0);
+	(void)old;
+}
+
+//////////////////////////////////////////////////////////////////
+// Instrumentation.
+//////////////////////////////////////////////////////////////////
+
+/** Account the coroutine getting the CPU. */
+static inline void
+coro_engine_stats_run(struct coro_engine *engine, struct coro *c,
+	uint64_t now)
+{
+	/* Could become runnable before the counters were on. */
+	if (c->ready_ns != 0 && c->ready_ns <= now) {
+		uint64_t wait = now - c->ready_ns;
+		c->stats.wait_ns += wait;
+		if (wait > c->stats.wait_max_ns)
+			c->stats.wait_max_ns = wait;
+	}
+	c->ready_ns = 0;
+	++c->stats.switch_count;
+	++engine->switch_count;
+	c->run_start_ns = now;
+}
+
+/** Account the coroutine giving the CPU away. */
+static inline void
+coro_engine_stats_stop(struct coro_engine *engine, struct coro *c,
+	uint64_t now)
+{
+	if (c->run_start_ns == 0)
+		return;
+	uint64_t run = now - c->run_start_ns;
+	c->stats.run_ns += run;
+	if (run > c->stats.run_max_ns)
+		c->stats.run_max_ns = run;
+	if (engine->trace != NULL) {
+		struct coro_trace_event *e =
+			&engine->trace[engine->trace_count++ %
+				       engine->trace_size];
+		e->coro = c;
+		e->start_ns = c->run_start_ns;
+		e->end_ns = now;
+	}
+	c->run_start_ns = 0;
+}
+
+/** Account a switch. The scheduler itself is not accounted. */
+static void
+coro_engine_stats_switch(struct coro_engine *engine, struct coro *from,
+	struct coro *to)
+{
+	uint64_t now = coro_clock_ns();
+	if (from != &engine->sched)
+		coro_engine_stats_stop(engine, from, now);
+	if (to != &engine->sched)
+		coro_engine_stats_run(engine, to, now);
+}
+
+static const char *const coro_state_strs[] = {
+	"running", "suspended", "finished", "notified", "parking",
+};
+
+static const char *const coro_prio_strs[CORO_PRIO_COUNT] = {
+	"high", "normal", "background",
+};
+
+static void
+coro_engine_dump(struct coro_engine *engine, FILE *out)
+{
+	size_t live_count = 0;
+	struct coro *c;
+	rlist_foreach_entry(c, &engine->coros_all, in_engine) {
+		if (c->state != CORO_STATE_FINISHED)
+			++live_count;
+	}
+	fprintf(out, "engine %p: coros %zu, runnable %zu, timers %zu, "
+		"io waits %zu, switches %llu\n", (void *)engine, live_count,
+		engine->run_count, engine->timer_count,
+		engine->io_wait_count,
+		(unsigned long long)engine->switch_count);
+	const struct coro_pool_stats *ps = &engine->pool_stats;
+	fprintf(out, "  pool: hit %zu, miss %zu, trim %zu, free %zu, "
+		"idle %zu, stack hwm %zu\n", ps->hit_count, ps->miss_count,
+		ps->trim_count, ps->free_count, ps->idle_count,
+		ps->stack_hwm);
+	rlist_foreach_entry(c, &engine->coros_all, in_engine) {
+		if (c->state == CORO_STATE_FINISHED)
+			continue;
+		const struct coro_stats *st = &c->stats;
+		fprintf(out, "  coro %p: %s, %s, switches %llu, "
+			"run %llu us (max %llu), wait %llu us (max %llu)\n",
+			(void *)c, coro_state_strs[c->state],
+			coro_prio_strs[c->prio],
+			(unsigned long long)st->switch_count,
+			(unsigned long long)(st->run_ns / 1000),
+			(unsigned long long)(st->run_max_ns / 1000),
+			(unsigned long long)(st->wait_ns / 1000),
+			(unsigned long long)(st->wait_max_ns / 1000));
+	}
+}
+
+/**
+ * Write the recorded runs of the engine as complete events of the
+ * Chrome trace format. The timestamps are in microseconds.
+ */
+static void
+coro_engine_trace_export(struct coro_engine *engine, int tid, FILE *out)
+{
+	fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":%d,\"args\":{\"name\":\"engine %d\"}}", tid, tid);
+	if (engine->trace == NULL)
+		return;
+	size_t count = engine->trace_count;
+	if (count > engine->trace_size)
+		count = engine->trace_size;
+	for (size_t i = engine->trace_count - count;
+	     i < engine->trace_count; ++i) {
+		const struct coro_trace_event *e =
+			&engine->trace[i % engine->trace_size];
+		/* The first run could start before the recording. */
+		uint64_t start = e->start_ns;
+		if (start < engine->trace_start_ns)
+			start = engine->trace_start_ns;
+		fprintf(out, ",\n{\"name\":\"coro %p\",\"ph\":\"X\","
+			"\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			(void *)e->coro, tid,
+			(start - engine->trace_start_ns) / 1000.0,
+			(e->end_ns - start) / 1000.0);
+	}
+}
+
+//////////////////////////////////////////////////////////////////
+
+/**
+ * Dispatch weights of the priorities. When all the classes are
+ * busy, they get the switches in this proportion.
+ */
+static const int coro_prio_weight[CORO_PRIO_COUNT] = {16, 4, 1};
+
+/**
+ * Take the next coroutine to run. That is a smooth weighted
+ * round-robin. Each non-empty queue ages by its weight at each
+ * pick, the oldest one is served and pays the total weight back.
+ * So the higher priorities are served first and more often, but a
+ * waiting queue becomes the oldest eventually and can't starve.
+ */
+static struct coro *
+coro_engine_pick(struct coro_engine *engine)
+{
+	assert(engine->run_count > 0);
+	int best = -1;
+	int total = 0;
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		if (rlist_empty(&engine->run_queue[i])) {
+			/* Idle queue doesn't save up credit. */
+			engine->run_credit[i] = 0;
+			continue;
+		}
+		engine->run_credit[i] += coro_prio_weight[i];
+		total += coro_prio_weight[i];
+		if (best < 0 ||
+		    engine->run_credit[i] > engine->run_credit[best])
+			best = i;
+	}
+	assert(best >= 0);
+	engine->run_credit[best] -= total;
+	--engine->run_count;
+	return rlist_shift_entry(&engine->run_queue[best], struct coro,
+		link);
+}
+
+/**
+ * Give the control to the next coroutine, or back to the scheduler
+ * when the iteration is over.
+ */
+static void
+coro_engine_resume_next(struct coro_engine *engine)
+{
+	struct coro *to = &engine->sched;
+	if (engine->round_left > 0 && engine->run_count > 0) {
+		--engine->round_left;
+		to = coro_engine_pick(engine);
+	}
+	struct coro *from = engine->this_coro;
+	assert(from != NULL);
+	if (to == from) {
+		/* Yielded, but got picked again right away. */
+		return;
+	}
+
+	engine->this_coro = NULL;
+	if (engine->is_stats_enabled)
+		coro_engine_stats_switch(engine, from, to);
+	coro_switch(from, to);
+	assert(rlist_empty(&from->link));
+	assert(engine->this_coro == NULL);
+	engine->this_coro = from;
+}
+
+static inline bool
+coro_is_cancelled_impl(struct coro *c)
+{
+	return __atomic_load_n(&c->cancel_state, __ATOMIC_ACQUIRE) !=
+		CORO_CANCEL_NONE;
+}
+
+/**
+ * Mark a pending cancellation as delivered. Only the coroutine
+ * itself does that. Returns true if it was pending.
+ */
+static inline bool
+coro_cancel_deliver(struct coro *c)
+{
+	if (__atomic_load_n(&c->cancel_state, __ATOMIC_ACQUIRE) !=
+	    CORO_CANCEL_PENDING)
+		return false;
+	__atomic_store_n(&c->cancel_state, CORO_CANCEL_DELIVERED,
+		__ATOMIC_RELAXED);
+	return true;
+}
+
+static void
+coro_engine_suspend(struct coro_engine *engine)
+{
+	struct coro *this_coro = engine->this_coro;
+	if (this_coro == NULL) {
+		printf("Error: deadlock - suspension with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	assert(rlist_empty(&this_coro->link));
+	/* The cancellation interrupts a suspension only once. */
+	if (coro_cancel_deliver(this_coro))
+		return;
+	if (engine->worker != NULL) {
+		coro_worker_suspend(engine);
+	} else {
+		assert(this_coro->state == CORO_STATE_RUNNING);
+		this_coro->state = CORO_STATE_SUSPENDED;
+		coro_engine_resume_next(engine);
+	}
+	/* Could be woken up by the cancellation. */
+	coro_cancel_deliver(this_coro);
+}
+
+static void
+coro_engine_yield(struct coro_engine *engine)
+{
+	struct coro *this_coro = engine->this_coro;
+	assert(rlist_empty(&this_coro->link));
+	if (engine->worker != NULL) {
+		coro_worker_switch_out(engine, CORO_WORKER_YIELD);
+		return;
+	}
+	assert(this_coro->state == CORO_STATE_RUNNING);
+	coro_engine_push(engine, this_coro);
+	coro_engine_resume_next(engine);
+}
+
+static void
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+{
+	if (engine->worker != NULL) {
+		coro_worker_wakeup(coro);
+		return;
+	}
+	if (coro->state == CORO_STATE_RUNNING)
+		return;
+	if (coro->state == CORO_STATE_FINISHED)
+		return;
+	assert(coro->state == CORO_STATE_SUSPENDED);
+	assert(rlist_empty(&coro->link));
+	coro->state = CORO_STATE_RUNNING;
+	coro_engine_push(engine, coro);
+}
+
+static void
+coro_engine_cancel(struct coro *coro)
+{
+	enum coro_cancel_state state = CORO_CANCEL_NONE;
+	if (__atomic_compare_exchange_n(&coro->cancel_state, &state,
+					CORO_CANCEL_PENDING, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		coro_engine_wakeup(coro->engine, coro);
+}
+
+//////////////////////////////////////////////////////////////////
+// Timers.
+//////////////////////////////////////////////////////////////////
+
+static inline void
+coro_engine_lock(struct coro_engine *engine)
+{
+	if (engine->worker != NULL)
+		pthread_mutex_lock(&engine->mutex);
+}
+
+static inline void
+coro_engine_unlock(struct coro_engine *engine)
+{
+	if (engine->worker != NULL)
+		pthread_mutex_unlock(&engine->mutex);
+}
+
+/**
+ * Put the timer into the wheel. The level is chosen by how far the
+ * deadline is from the current tick, and the slot by the deadline
+ * bits of that level. So a slot of a non-zero level is cascaded
+ * into the lower levels exactly when its time range begins.
+ */
+static void
+coro_engine_timer_link(struct coro_engine *engine, struct coro_timer *t)
+{
+	uint64_t pos = t->deadline;
+	int level = 0;
+	if (pos < engine->timer_tick) {
+		/* Expired already, fire on the next tick. */
+		pos = engine->timer_tick;
+	} else {
+		uint64_t delta = pos - engine->timer_tick;
+		while (level < CORO_TIMER_LEVEL_COUNT - 1 &&
+		       delta >> (CORO_TIMER_SLOT_LOG * (level + 1)) != 0)
+			++level;
+		uint64_t range = 1ull << (CORO_TIMER_SLOT_LOG *
+			CORO_TIMER_LEVEL_COUNT);
+		if (delta >= range)
+			pos = engine->timer_tick + range - 1;
+	}
+	int slot = (pos >> (CORO_TIMER_SLOT_LOG * level)) &
+		(CORO_TIMER_SLOT_COUNT - 1);
+	t->level = level;
+	t->slot = slot;
+	rlist_add_tail_entry(&engine->timers[level][slot], t, link);
+	engine->timer_slot_mask[level] |= 1ull << slot;
+}
+
+/**
+ * The nearest tick at which something happens in the wheel - either
+ * a level 0 slot expires or a higher level slot gets cascaded.
+ */
+static uint64_t
+coro_engine_timer_next(struct coro_engine *engine)
+{
+	uint64_t tick = engine->timer_tick;
+	uint64_t next = UINT64_MAX;
+	for (int level = 0; level < CORO_TIMER_LEVEL_COUNT; ++level) {
+		uint64_t mask = engine->timer_slot_mask[level];
+		if (mask == 0)
+			continue;
+		int shift = CORO_TIMER_SLOT_LOG * level;
+		uint64_t block = tick >> shift;
+		int cur = block & (CORO_TIMER_SLOT_COUNT - 1);
+		/* Rotate, so the current slot is the bit 0. */
+		mask = (mask >> cur) |
+			(mask << ((CORO_TIMER_SLOT_COUNT - cur) &
+				  (CORO_TIMER_SLOT_COUNT - 1)));
+		/*
+		 * The current slot is processed now only if the tick is
+		 * its first one. Otherwise it is the next round.
+		 */
+		if ((tick & ((1ull << shift) - 1)) != 0)
+			mask &= ~1ull;
+		uint64_t step = mask != 0 ? __builtin_ctzll(mask) :
+			CORO_TIMER_SLOT_COUNT;
+		uint64_t at = (block + step) << shift;
+		if (at < next)
+			next = at;
+	}
+	return next;
+}
+
+/** Process the current tick and move to the next one. */
+static void
+coro_engine_timer_tick(struct coro_engine *engine)
+{
+	uint64_t tick = engine->timer_tick;
+	for (int level = 1; level < CORO_TIMER_LEVEL_COUNT; ++level) {
+		int shift = CORO_TIMER_SLOT_LOG * level;
+		if ((tick & ((1ull << shift) - 1)) != 0)
+			break;
+		int slot = (tick >> shift) & (CORO_TIMER_SLOT_COUNT - 1);
+		struct rlist cascade;
+		rlist_create(&cascade);
+		rlist_splice(&cascade, &engine->timers[level][slot]);
+		engine->timer_slot_mask[level] &= ~(1ull << slot);
+		while (!rlist_empty(&cascade)) {
+			struct coro_timer *t = rlist_shift_entry(&cascade,
+				struct coro_timer, link);
+			coro_engine_timer_link(engine, t);
+		}
+	}
+	int slot = tick & (CORO_TIMER_SLOT_COUNT - 1);
+	struct rlist *list = &engine->timers[0][slot];
+	while (!rlist_empty(list)) {
+		struct coro_timer *t = rlist_shift_entry(list,
+			struct coro_timer, link);
+		assert(t->deadline <= tick);
+		struct coro *c = t->coro;
+		--engine->timer_count;
+		/* The timer can't be touched after that. */
+		__atomic_store_n(&t->is_fired, true, __ATOMIC_RELEASE);
+		coro_engine_wakeup(engine, c);
+	}
+	engine->timer_slot_mask[0] &= ~(1ull << slot);
+	engine->timer_tick = tick + 1;
+}
+
+/**
+ * Fire all the timers expired by now. The ticks without anything
+ * to do are skipped.
+ */
+static void
+coro_engine_process_timers(struct coro_engine *engine)
+{
+	coro_engine_lock(engine);
+	if (engine->timer_count > 0) {
+		uint64_t now = coro_clock_ns() >> CORO_TIMER_TICK_LOG;
+		while (engine->timer_tick <= now) {
+			uint64_t next = coro_engine_timer_next(engine);
+			if (next > now) {
+				engine->timer_tick = now + 1;
+				break;
+			}
+			engine->timer_tick = next;
+			coro_engine_timer_tick(engine);
+		}
+	}
+	coro_engine_unlock(engine);
+}
+
+/**
+ * Time in nanoseconds when the wheel has something to do next.
+ * UINT64_MAX if there are no timers.
+ */
+static uint64_t
+coro_engine_timer_deadline(struct coro_engine *engine)
+{
+	coro_engine_lock(engine);
+	uint64_t next = UINT64_MAX;
+	if (engine->timer_count > 0)
+		next = coro_engine_timer_next(engine) << CORO_TIMER_TICK_LOG;
+	coro_engine_unlock(engine);
+	return next;
+}
+
+/** Arm a timer waking up the current coroutine after the timeout. */
+static void
+coro_engine_timer_start(struct coro_engine *engine, struct coro_timer *t,
+	uint64_t timeout_ns)
+{
+	uint64_t now = coro_clock_ns();
+	if (timeout_ns > UINT64_MAX / 2)
+		timeout_ns = UINT64_MAX / 2;
+	/* Round up, so the sleep is never shorter than asked. */
+	t->deadline = (now >> CORO_TIMER_TICK_LOG) +
+		((timeout_ns + (1ull << CORO_TIMER_TICK_LOG) - 1) >>
+		 CORO_TIMER_TICK_LOG) + 1;
+	t->coro = engine->this_coro;
+	t->engine = engine;
+	t->is_fired = false;
+	coro_engine_lock(engine);
+	if (engine->timer_count == 0) {
+		/* Nothing to cascade, can jump right to now. */
+		engine->timer_tick = now >> CORO_TIMER_TICK_LOG;
+	}
+	coro_engine_timer_link(engine, t);
+	++engine->timer_count;
+	coro_engine_unlock(engine);
+}
+
+/**
+ * Remove the timer from the wheel. Returns false if it has already
+ * fired. The coroutine might be on another worker by now, so the
+ * timer is removed from the engine it was armed in.
+ */
+static bool
+coro_timer_cancel(struct coro_timer *t)
+{
+	struct coro_engine *engine = t->engine;
+	coro_engine_lock(engine);
+	bool is_fired = __atomic_load_n(&t->is_fired, __ATOMIC_ACQUIRE);
+	if (!is_fired) {
+		rlist_del_entry(t, link);
+		struct rlist *slot = &engine->timers[t->level][t->slot];
+		if (rlist_empty(slot))
+			engine->timer_slot_mask[t->level] &= ~(1ull << t->slot);
+		assert(engine->timer_count > 0);
+		--engine->timer_count;
+	}
+	coro_engine_unlock(engine);
+	return !is_fired;
+}
+
+static void
+coro_engine_sleep(struct coro_engine *engine, uint64_t timeout_ns)
+{
+	struct coro_timer timer;
+	coro_engine_timer_start(engine, &timer, timeout_ns);
+	while (!__atomic_load_n(&timer.is_fired, __ATOMIC_ACQUIRE)) {
+		if (coro_is_cancelled_impl(engine->this_coro)) {
+			coro_timer_cancel(&timer);
+			return;
+		}
+		coro_engine_suspend(engine);
+		engine = coro_engine_cur();
+	}
+}
+
+static bool
+coro_engine_suspend_timeout(struct coro_engine *engine, uint64_t timeout_ns)
+{
+	struct coro_timer timer;
+	coro_engine_timer_start(engine, &timer, timeout_ns);
+	coro_engine_suspend(engine);
+	return coro_timer_cancel(&timer);
+}
+
+//////////////////////////////////////////////////////////////////
+// I/O.
+//////////////////////////////////////////////////////////////////
+
+/**
+ * A coroutine waiting for events on a descriptor. Lives on its
+ * stack, in the wait list of the descriptor.
+ */
+struct coro_io_wait {
+	/** Coroutine to wake up. */
+	struct coro *coro;
+	/** Awaited events, CORO_EVENT_*. */
+	int events;
+	/** Happened events, CORO_EVENT_*. */
+	int revents;
+	/** Link in coro_fd.waits. */
+	struct rlist link;
+};
+
+/**
+ * A descriptor registered in the epoll of an engine. It is
+ * registered once for all its waiters, as one-shot, with the union
+ * of their events. The waiters which got their events are removed,
+ * and the rest re-arm it. The registration is dropped when the last
+ * waiter leaves.
+ */
+struct coro_fd {
+	/** Waiters, struct coro_io_wait. */
+	struct rlist waits;
+	/** Events the descriptor is armed for, EPOLL*. */
+	uint32_t mask;
+};
+
+/** Epoll descriptor of the engine, created on the first use. */
+static int
+coro_engine_epoll_fd(struct coro_engine *engine)
+{
+	if (engine->epoll_fd < 0) {
+		engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (engine->epoll_fd < 0)
+			handle_error();
+	}
+	return engine->epoll_fd;
+}
+
+/** Epoll events to arm a descriptor for all its waiters. */
+static uint32_t
+coro_fd_mask(struct coro_fd *f)
+{
+	uint32_t mask = 0;
+	struct coro_io_wait *wait;
+	rlist_foreach_entry(wait, &f->waits, link) {
+		if ((wait->events & CORO_EVENT_READ) != 0)
+			mask |= EPOLLIN | EPOLLRDHUP;
+		if ((wait->events & CORO_EVENT_WRITE) != 0)
+			mask |= EPOLLOUT;
+	}
+	return mask;
+}
+
+/**
+ * Re-arm the descriptor for the remaining waiters, or unregister
+ * it when there are none.
+ */
+static void
+coro_engine_fd_update(struct coro_engine *engine, int fd)
+{
+	struct coro_fd *f = engine->fds[fd];
+	if (rlist_empty(&f->waits)) {
+		epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		engine->fds[fd] = NULL;
+		delete f;
+		return;
+	}
+	uint32_t mask = coro_fd_mask(f);
+	if (mask == f->mask)
+		return;
+	struct epoll_event ev;
+	ev.events = mask | EPOLLONESHOT;
+	ev.data.u64 = (uint64_t)fd + 1;
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0)
+		handle_error();
+	f->mask = mask;
+}
+
+/**
+ * Add a waiter to the descriptor, registering it in the epoll when
+ * it is the first one.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+static int
+coro_engine_fd_add_wait(struct coro_engine *engine, int fd,
+	struct coro_io_wait *wait)
+{
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if (fd >= engine->fd_capacity) {
+		int capacity = engine->fd_capacity == 0 ? 64 :
+			engine->fd_capacity;
+		while (capacity <= fd)
+			capacity *= 2;
+		struct coro_fd **fds = (struct coro_fd **)realloc(engine->fds,
+			capacity * sizeof(fds[0]));
+		if (fds == NULL)
+			handle_error();
+		memset(fds + engine->fd_capacity, 0,
+			(capacity - engine->fd_capacity) * sizeof(fds[0]));
+		engine->fds = fds;
+		engine->fd_capacity = capacity;
+	}
+	struct coro_fd *f = engine->fds[fd];
+	if (f != NULL) {
+		rlist_add_tail_entry(&f->waits, wait, link);
+		coro_engine_fd_update(engine, fd);
+		return 0;
+	}
+	f = new coro_fd();
+	rlist_create(&f->waits);
+	rlist_add_tail_entry(&f->waits, wait, link);
+	f->mask = coro_fd_mask(f);
+	struct epoll_event ev;
+	ev.events = f->mask | EPOLLONESHOT;
+	ev.data.u64 = (uint64_t)fd + 1;
+	if (epoll_ctl(coro_engine_epoll_fd(engine), EPOLL_CTL_ADD, fd,
+		      &ev) != 0) {
+		delete f;
+		return -1;
+	}
+	engine->fds[fd] = f;
+	return 0;
+}
+
+/**
+ * Wake up the waiters of a descriptor for the happened events, and
+ * re-arm it for the rest.
+ */
+static void
+coro_engine_fd_dispatch(struct coro_engine *engine, int fd, uint32_t e)
+{
+	int revents = 0;
+	if ((e & (EPOLLIN | EPOLLRDHUP)) != 0)
+		revents |= CORO_EVENT_READ;
+	if ((e & EPOLLOUT) != 0)
+		revents |= CORO_EVENT_WRITE;
+	/* Let the subsequent call report the error. */
+	if ((e & (EPOLLERR | EPOLLHUP)) != 0)
+		revents |= CORO_EVENT_READ | CORO_EVENT_WRITE;
+	/* Unregistered while the worker was waiting without the lock. */
+	if (fd >= engine->fd_capacity || engine->fds[fd] == NULL)
+		return;
+	struct coro_fd *f = engine->fds[fd];
+	/* The one-shot registration is disarmed now. */
+	f->mask = 0;
+	struct coro_io_wait *wait, *tmp;
+	rlist_foreach_entry_safe(wait, &f->waits, link, tmp) {
+		int ready = wait->events & revents;
+		if (ready == 0)
+			continue;
+		rlist_del_entry(wait, link);
+		struct coro *c = wait->coro;
+		__atomic_store_n(&wait->revents, ready, __ATOMIC_RELEASE);
+		coro_engine_wakeup(engine, c);
+	}
+	coro_engine_fd_update(engine, fd);
+}
+
+/**
+ * Wait for the I/O events not longer than the timeout, and wake up
+ * the coroutines waiting for them. The wait itself is done without
+ * the lock, so an idle worker can sleep here while a migrated
+ * coroutine unregisters its wait. The events are dispatched under
+ * the lock.
+ */
+static void
+coro_engine_poll(struct coro_engine *engine, int timeout_ms)
+{
+	struct epoll_event events[CORO_POLL_BATCH];
+	if (timeout_ms == 0) {
+		coro_engine_lock(engine);
+		bool is_idle = engine->io_wait_count == 0 &&
+			engine->remote_count == 0;
+		coro_engine_unlock(engine);
+		if (is_idle)
+			return;
+	}
+	int count = epoll_wait(engine->epoll_fd, events, CORO_POLL_BATCH,
+		timeout_ms);
+	if (count <= 0)
+		return;
+	coro_engine_lock(engine);
+	for (int i = 0; i < count; ++i) {
+		uint64_t data = events[i].data.u64;
+		if (data == 0) {
+			/* The eventfd. The inbox is taken separately. */
+			uint64_t value;
+			if (read(engine->event_fd, &value, sizeof(value)) < 0)
+				assert(errno == EAGAIN);
+			continue;
+		}
+		coro_engine_fd_dispatch(engine, (int)(data - 1),
+			events[i].events);
+	}
+	coro_engine_unlock(engine);
+}
+
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events,
+	uint64_t timeout_ns)
+{
+	assert((events & ~(CORO_EVENT_READ | CORO_EVENT_WRITE)) == 0);
+	struct coro *this_coro = engine->this_coro;
+	if (coro_is_cancelled_impl(this_coro)) {
+		errno = ECANCELED;
+		return -1;
+	}
+	struct coro_io_wait wait;
+	wait.coro = this_coro;
+	wait.events = events;
+	wait.revents = 0;
+
+	struct coro_engine *owner = engine;
+	coro_engine_lock(owner);
+	int rc = coro_engine_fd_add_wait(owner, fd, &wait);
+	if (rc == 0)
+		++owner->io_wait_count;
+	coro_engine_unlock(owner);
+	if (rc != 0) {
+		/* Regular files are not pollable, but always ready. */
+		if (errno == EPERM)
+			return events;
+		return -1;
+	}
+
+	struct coro_timer timer;
+	bool has_timer = timeout_ns != UINT64_MAX;
+	if (has_timer)
+		coro_engine_timer_start(engine, &timer, timeout_ns);
+	while (__atomic_load_n(&wait.revents, __ATOMIC_ACQUIRE) == 0 &&
+	       !(has_timer &&
+		 __atomic_load_n(&timer.is_fired, __ATOMIC_ACQUIRE)) &&
+	       !coro_is_cancelled_impl(this_coro)) {
+		coro_engine_suspend(engine);
+		engine = coro_engine_cur();
+	}
+	if (has_timer)
+		coro_timer_cancel(&timer);
+
+	coro_engine_lock(owner);
+	int revents = wait.revents;
+	if (revents == 0) {
+		/* Timed out or cancelled, still in the list. */
+		rlist_del_entry(&wait, link);
+		coro_engine_fd_update(owner, fd);
+	}
+	assert(owner->io_wait_count > 0);
+	--owner->io_wait_count;
+	coro_engine_unlock(owner);
+	if (revents == 0 && coro_is_cancelled_impl(this_coro)) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return revents;
+}
+
+//////////////////////////////////////////////////////////////////
+// Remote wakeups.
+//////////////////////////////////////////////////////////////////
+
+/**
+ * Add an eventfd to the epoll of the engine, so another thread can
+ * wake it up while it sleeps.
+ */
+static void
+coro_engine_event_fd_open(struct coro_engine *engine)
+{
+	if (engine->event_fd >= 0)
+		return;
+	engine->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (engine->event_fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	if (epoll_ctl(coro_engine_epoll_fd(engine), EPOLL_CTL_ADD,
+		      engine->event_fd, &ev) != 0)
+		handle_error();
+}
+
+/**
+ * Start expecting a wakeup from another thread. The engine gets an
+ * eventfd in its epoll, so it can be woken up while sleeping.
+ */
+static void
+coro_engine_remote_start(struct coro_engine *engine, struct coro_remote *r)
+{
+	r->coro = engine->this_coro;
+	r->next = NULL;
+	r->is_done = false;
+	/* A worker pool runs anyway while the coroutine is alive. */
+	if (engine->worker != NULL)
+		return;
+	coro_engine_event_fd_open(engine);
+	++engine->remote_count;
+}
+
+/**
+ * Deliver a remote wakeup from any thread. The request is pushed
+ * into the inbox of the engine, which doesn't take any locks. The
+ * eventfd is written only when the engine sleeps.
+ */
+static void
+coro_engine_remote_signal(struct coro_remote *r)
+{
+	struct coro *c = r->coro;
+	struct coro_engine *engine = c->engine;
+	if (engine->worker != NULL) {
+		/* The request can be gone right after that. */
+		__atomic_store_n(&r->is_done, true, __ATOMIC_RELEASE);
+		coro_worker_wakeup(c);
+		return;
+	}
+	/*
+	 * The request is not touched after the push. It is the
+	 * engine who marks it done, so the waiter can't leave
+	 * while it is still used here.
+	 */
+	struct coro_remote *head = __atomic_load_n(&engine->inbox,
+		__ATOMIC_RELAXED);
+	do {
+		r->next = head;
+	} while (!__atomic_compare_exchange_n(&engine->inbox, &head, r, true,
+					      __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+	if (__atomic_load_n(&engine->is_sleeping, __ATOMIC_SEQ_CST))
+		coro_engine_poke(engine);
+}
+
+/** Take all the remote wakeups and apply them in arrival order. */
+static void
+coro_engine_inbox_drain(struct coro_engine *engine)
+{
+	if (__atomic_load_n(&engine->inbox, __ATOMIC_RELAXED) == NULL)
+		return;
+	struct coro_remote *r = __atomic_exchange_n(&engine->inbox, NULL,
+		__ATOMIC_ACQUIRE);
+	struct coro_remote *list = NULL;
+	while (r != NULL) {
+		struct coro_remote *next = r->next;
+		r->next = list;
+		list = r;
+		r = next;
+	}
+	while (list != NULL) {
+		r = list;
+		list = r->next;
+		struct coro *c = r->coro;
+		assert(engine->remote_count > 0);
+		--engine->remote_count;
+		__atomic_store_n(&r->is_done, true, __ATOMIC_RELEASE);
+		coro_engine_wakeup(engine, c);
+	}
+}
+
+/**
+ * Stop expecting a wakeup which is never going to be signaled. The
+ * request is done right away, without a trip through the inbox.
+ */
+static void
+coro_engine_remote_cancel(struct coro_remote *r)
+{
+	struct coro_engine *engine = r->coro->engine;
+	assert(r->coro == engine->this_coro ||
+	       engine->worker != NULL);
+	if (engine->worker == NULL) {
+		assert(engine->remote_count > 0);
+		--engine->remote_count;
+	}
+	__atomic_store_n(&r->is_done, true, __ATOMIC_RELEASE);
+}
+
+static void
+coro_engine_remote_wait(struct coro_engine *engine, struct coro_remote *r)
+{
+	assert(r->coro == engine->this_coro);
+	while (!__atomic_load_n(&r->is_done, __ATOMIC_ACQUIRE)) {
+		coro_engine_suspend(engine);
+		engine = coro_engine_cur();
+	}
+}
+
+//////////////////////////////////////////////////////////////////
+
+/**
+ * Wait until there is something to run. The thread sleeps in
+ * epoll_wait() when there are I/O waits or remote wakeups to
+ * expect, and until the nearest timer in any case.
+ */
+static void
+coro_engine_wait(struct coro_engine *engine)
+{
+	uint64_t deadline = coro_engine_timer_deadline(engine);
+	if (engine->remote_count > 0) {
+		/*
+		 * Either the signaler sees the flag and pokes the
+		 * eventfd, or the inbox is seen non-empty here.
+		 */
+		__atomic_store_n(&engine->is_sleeping, true,
+			__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&engine->inbox, __ATOMIC_SEQ_CST) !=
+		    NULL) {
+			__atomic_store_n(&engine->is_sleeping, false,
+				__ATOMIC_RELAXED);
+			return;
+		}
+	}
+	if (engine->io_wait_count > 0 || engine->remote_count > 0) {
+		int timeout_ms = -1;
+		if (deadline != UINT64_MAX) {
+			uint64_t now = coro_clock_ns();
+			uint64_t timeout = deadline > now ? deadline - now : 0;
+			/* Round up to not wake up before the timer. */
+			timeout = (timeout + 999999) / 1000000;
+			timeout_ms = timeout > INT32_MAX ? INT32_MAX : timeout;
+		}
+		coro_engine_poll(engine, timeout_ms);
+		__atomic_store_n(&engine->is_sleeping, false,
+			__ATOMIC_RELAXED);
+		return;
+	}
+	assert(deadline != UINT64_MAX);
+	struct timespec ts;
+	ts.tv_sec = deadline / 1000000000;
+	ts.tv_nsec = deadline % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			       NULL) == EINTR)
+		;
+}
+
+//////////////////////////////////////////////////////////////////
+
+static void
+coro_engine_run(struct coro_engine *engine)
+{
+	while (true) {
+		coro_engine_inbox_drain(engine);
+		coro_engine_process_timers(engine);
+		coro_engine_poll(engine, 0);
+		if (engine->run_count == 0) {
+			if (engine->timer_count == 0 &&
+			    engine->io_wait_count == 0 &&
+			    engine->remote_count == 0)
+				break;
+			coro_engine_wait(engine);
+			continue;
+		}
+
+		assert(engine->this_coro == NULL);
+		engine->this_coro = &engine->sched;
+		/*
+		 * Each coroutine runnable by now can get a turn
+		 * before the control comes back.
+		 */
+		engine->round_left = engine->run_count;
+		coro_engine_resume_next(engine);
+		assert(engine->this_coro == &engine->sched);
+		engine->this_coro = NULL;
+	}
+}
+
+static void
+coro_engine_destroy(struct coro_engine *engine)
+{
+	assert(engine->this_coro == NULL);
+	assert(engine->run_count == 0);
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+		assert(rlist_empty(&engine->run_queue[i]));
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct rlist *pool = &engine->coros_pool[i];
+		while (!rlist_empty(pool)) {
+			struct coro *c = rlist_shift_entry(pool,
+				struct coro, link);
+			/*
+			 * A worker pool destroys all the engines
+			 * together, the lists don't matter anymore.
+			 */
+			if (engine->worker == NULL)
+				rlist_del_entry(c, in_engine);
+			coro_stack_delete(c->stack, c->stack_size);
+			delete c;
+			coro_engine_count_add(engine, -1);
+			assert(engine->pool_stats.idle_count > 0);
+			--engine->pool_stats.idle_count;
+		}
+	}
+	while (!rlist_empty(&engine->coros_stackless)) {
+		delete rlist_shift_entry(&engine->coros_stackless,
+			struct coro, link);
+		coro_engine_count_add(engine, -1);
+	}
+	assert(engine->coro_count == 0);
+	assert(engine->timer_count == 0);
+	assert(engine->io_wait_count == 0);
+	assert(engine->remote_count == 0);
+	assert(engine->inbox == NULL);
+	if (engine->event_fd >= 0)
+		close(engine->event_fd);
+	if (engine->epoll_fd >= 0)
+		close(engine->epoll_fd);
+	for (int i = 0; i < engine->fd_capacity; ++i)
+		assert(engine->fds[i] == NULL);
+	free(engine->fds);
+	delete[] engine->trace;
+	pthread_mutex_destroy(&engine->mutex);
+	memset(engine, '#', sizeof(*engine));
+}
+
+/**
+ * Move a finished member to the finished list of its group, and
+ * wake up the group waiter. Called before the coroutine becomes
+ * joinable - the waiter then joins it as usual.
+ */
+static void
+coro_group_finish(struct coro *c)
+{
+	struct coro_group *group = c->group;
+	pthread_mutex_lock(&group->mutex);
+	rlist_del_entry(c, in_group);
+	rlist_add_tail_entry(&group->finished, c, in_group);
+	struct coro *waiter = group->waiter;
+	if (waiter != NULL)
+		coro_engine_wakeup(waiter->engine, waiter);
+	pthread_mutex_unlock(&group->mutex);
+}
+
+/**
+ * Coroutine main loop. Runs the coroutine function, and once it
+ * is finished, gives the control away until the coroutine is
+ * taken from the pool and restarted with a new function.
+ */
+static void
+coro_engine_body(struct coro *c)
+{
+	struct coro_engine *engine = coro_engine_cur();
+	engine->this_coro = c;
+	while (true) {
+		c->ret = c->func(c->func_arg);
+		c->func = NULL;
+		if (c->group != NULL)
+			coro_group_finish(c);
+		engine = coro_engine_cur();
+		if (engine->worker != NULL) {
+			/*
+			 * The worker makes it finished once it is
+			 * off the stack. Otherwise the joiner could
+			 * reuse the stack too early.
+			 */
+			coro_worker_switch_out(engine, CORO_WORKER_FINISH);
+		} else {
+			assert(c->state == CORO_STATE_RUNNING);
+			c->state = CORO_STATE_FINISHED;
+			if (c->joiner != NULL)
+				coro_engine_wakeup(engine, c->joiner);
+			coro_engine_resume_next(engine);
+		}
+		/*
+		 * Here it is restarted already, must have its
+		 * state restored.
+		 */
+		assert(c->state != CORO_STATE_FINISHED);
+		assert(c->func != NULL);
+	}
+}
+
+#if LIBCORO_SIGNAL_SWITCH
+
+static __thread struct coro_engine *new_coro_engine = NULL;
+
+/**
+ * The core part of the coroutines creation - this signal handler
+ * runs on a separate stack using sigaltstack. At invocation it
+ * remembers its current context and jumps back to the coroutine
+ * constructor. Later the coroutine continues from here.
+ */
+static void
+coro_body(int signum)
+{
+	(void)signum;
+	struct coro_engine *my_engine = new_coro_engine;
+	new_coro_engine = NULL;
+
+	struct coro *c = my_engine->this_coro;
+	my_engine->this_coro = NULL;
+	/*
+	 * On invocation jump back to the constructor right after
+	 * remembering the context.
+	 */
+	if (sigsetjmp(c->ctx, 0) == 0)
+		siglongjmp(my_engine->start_point, 1);
+	/*
+	 * If the execution is here, then the coroutine should
+	 * finally start work.
+	 */
+	coro_engine_body(c);
+}
+
+/**
+ * Prepare the context of a new coroutine so as the first switch
+ * to it would start its body on the given stack.
+ */
+static void
+coro_ctx_create(struct coro_engine *engine, struct coro *c)
+{
+	/*
+	 * SIGUSR2 is used. First of all, block new signals to be
+	 * able to set a new handler.
+	 */
+	sigset_t news, olds, suss;
+	sigemptyset(&news);
+	sigaddset(&news, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
 		handle_error();
 	/*
 	 * New handler should jump onto a new stack and remember
@@ -269,139 +2146,1100 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	/* Create that new stack. */
 	stack_t oldst, newst;
 	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_size = c->stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 
-	/* Jump onto the stack and remember its position. */
-	assert(new_coro_engine == NULL);
-	new_coro_engine = engine;
-	struct coro *old_this = engine->this_coro;
-	engine->this_coro = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(engine->start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (engine->this_coro != NULL)
-			sigsuspend(&suss);
+	/* Jump onto the stack and remember its position. */
+	assert(new_coro_engine == NULL);
+	new_coro_engine = engine;
+	struct coro *old_this = engine->this_coro;
+	engine->this_coro = c;
+	sigemptyset(&suss);
+	if (sigsetjmp(engine->start_point, 1) == 0) {
+		raise(SIGUSR2);
+		while (engine->this_coro != NULL)
+			sigsuspend(&suss);
+	}
+	assert(new_coro_engine == NULL);
+	engine->this_coro = old_this;
+
+	/*
+	 * Return the old stack, unblock SIGUSR2. In other words,
+	 * rollback all global changes. The newly created stack
+	 * now is remembered only by the new coroutine, and can be
+	 * used by it only.
+	 */
+	if (sigaltstack(NULL, &newst) != 0)
+		handle_error();
+	newst.ss_flags = SS_DISABLE;
+	if (sigaltstack(&newst, NULL) != 0)
+		handle_error();
+	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
+	    sigaltstack(&oldst, NULL) != 0)
+		handle_error();
+	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
+		handle_error();
+	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+		handle_error();
+}
+
+#else /* !LIBCORO_SIGNAL_SWITCH */
+
+/** Entry point of a new coroutine, called by coro_ctx_start. */
+static void
+coro_ctx_main(struct coro *c)
+{
+	coro_engine_body(c);
+}
+
+/**
+ * Prepare the context of a new coroutine so as the first switch
+ * to it would start its body on the given stack. No syscalls -
+ * the initial frame is simply written on top of the stack as if
+ * the coroutine has called coro_ctx_switch() from coro_ctx_start.
+ */
+static void
+coro_ctx_create(struct coro_engine *engine, struct coro *c)
+{
+	(void)engine;
+	void (*entry)(struct coro *) = coro_ctx_main;
+	uintptr_t top = (uintptr_t)c->stack + c->stack_size;
+	top &= ~(uintptr_t)15;
+	void **sp = (void **)top - CORO_CTX_SLOT_COUNT;
+	memset(sp, 0, CORO_CTX_SLOT_COUNT * sizeof(*sp));
+	sp[CORO_CTX_SLOT_CORO] = c;
+	sp[CORO_CTX_SLOT_FUNC] = (void *)entry;
+	sp[CORO_CTX_SLOT_RET] = (void *)coro_ctx_start;
+	c->ctx = sp;
+}
+
+#endif /* !LIBCORO_SIGNAL_SWITCH */
+
+/**
+ * Make the spawned coroutine a member of the group. It must be
+ * done before it can run and finish.
+ */
+static void
+coro_group_add(struct coro_group *group, struct coro *c)
+{
+	c->group = group;
+	c->cancel_state = CORO_CANCEL_NONE;
+	if (group == NULL)
+		return;
+	pthread_mutex_lock(&group->mutex);
+	if (group->is_cancelled)
+		c->cancel_state = CORO_CANCEL_PENDING;
+	rlist_add_tail_entry(&group->members, c, in_group);
+	pthread_mutex_unlock(&group->mutex);
+}
+
+static struct coro *
+coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg,
+	int stack_class, enum coro_prio prio, struct coro_group *group)
+{
+	size_t stack_size = (size_t)1 <<
+		(stack_class + CORO_STACK_CLASS_MIN_LOG);
+	uint8_t *stack = coro_stack_new(stack_size);
+	if (stack == NULL)
+		return NULL;
+	struct coro *c;
+	bool is_new = rlist_empty(&engine->coros_stackless);
+	if (is_new) {
+		c = new coro();
+		rlist_add_tail_entry(&engine->coros_all, c, in_engine);
+	} else {
+		c = rlist_shift_entry(&engine->coros_stackless, struct coro,
+			link);
+	}
+	c->prio = prio;
+	c->ret = NULL;
+	c->stack_class = stack_class;
+	c->stack_size = stack_size;
+	c->stack = stack;
+	c->stack_hwm = 0;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->joiner = NULL;
+	c->engine = engine;
+	memset(c->specific, 0, sizeof(c->specific));
+	memset(&c->stats, 0, sizeof(c->stats));
+	c->ready_ns = 0;
+	c->run_start_ns = 0;
+	rlist_create(&c->link);
+	rlist_create(&c->in_group);
+	coro_ctx_create(engine, c);
+	coro_group_add(group, c);
+
+	/* Now scheduler can work with that coroutine. */
+	__atomic_store_n(&c->state, CORO_STATE_RUNNING, __ATOMIC_RELEASE);
+	if (is_new)
+		coro_engine_count_add(engine, 1);
+	assert(rlist_empty(&c->link));
+	coro_engine_push(engine, c);
+	return c;
+}
+
+static struct coro *
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	size_t stack_size, enum coro_prio prio, struct coro_group *group)
+{
+	if (engine->worker != NULL) {
+		__atomic_add_fetch(&engine->worker->pool->active_count, 1,
+			__ATOMIC_RELAXED);
+	}
+	int stack_class = coro_stack_class(stack_size);
+	struct rlist *pool = &engine->coros_pool[stack_class];
+	if (rlist_empty(pool)) {
+		++engine->pool_stats.miss_count;
+		struct coro *c = coro_engine_spawn_new(engine, func, func_arg,
+			stack_class, prio, group);
+		if (c == NULL && engine->worker != NULL) {
+			__atomic_sub_fetch(&engine->worker->pool->active_count,
+				1, __ATOMIC_RELAXED);
+		}
+		return c;
+	}
+	++engine->pool_stats.hit_count;
+	assert(engine->pool_stats.idle_count > 0);
+	--engine->pool_stats.idle_count;
+	struct coro *c = rlist_shift_entry(pool, struct coro, link);
+	c->func = func;
+	c->func_arg = func_arg;
+	c->engine = engine;
+	c->prio = prio;
+	memset(&c->stats, 0, sizeof(c->stats));
+	c->ready_ns = 0;
+	c->run_start_ns = 0;
+	coro_group_add(group, c);
+	__atomic_store_n(&c->state, CORO_STATE_RUNNING, __ATOMIC_RELEASE);
+	assert(rlist_empty(&c->link));
+	coro_engine_push(engine, c);
+	return c;
+}
+
+/**
+ * Put a finished coroutine into the pool. The hot part of the pool
+ * is used as is. Beyond it the stacks are trimmed and go to the
+ * tail, to be reused last. When the pool is full, the coroutine is
+ * freed right away, so the memory stays bounded after load spikes.
+ *
+ * The worker pool never deletes the objects until destroyed - a
+ * late wakeup from another thread might still touch them. Only the
+ * stack is freed, and the object waits for a new one.
+ */
+static void
+coro_engine_recycle(struct coro_engine *engine, struct coro *coro)
+{
+	assert(rlist_empty(&coro->link));
+	struct coro_pool_stats *stats = &engine->pool_stats;
+	bool is_full = stats->idle_count >= engine->pool_max_count;
+	if (is_full) {
+		coro_stack_delete(coro->stack, coro->stack_size);
+		coro->stack = NULL;
+		++stats->free_count;
+		if (engine->worker != NULL) {
+			rlist_add_entry(&engine->coros_stackless, coro, link);
+			return;
+		}
+		rlist_del_entry(coro, in_engine);
+		delete coro;
+		coro_engine_count_add(engine, -1);
+		return;
+	}
+	struct rlist *pool = &engine->coros_pool[coro->stack_class];
+	++stats->idle_count;
+	bool is_hot = stats->idle_count <= engine->pool_hot_count;
+	/* The mark costs a syscall, a hot stack needs it only for stats. */
+	if (!is_hot || engine->is_stats_enabled) {
+		size_t hwm = coro_stack_watermark(coro);
+		if (hwm > stats->stack_hwm)
+			stats->stack_hwm = hwm;
+	}
+	if (is_hot) {
+		rlist_add_entry(pool, coro, link);
+		return;
+	}
+	if (coro_stack_trim(coro, engine->pool_keep_size))
+		++stats->trim_count;
+	rlist_add_tail_entry(pool, coro, link);
+}
+
+//////////////////////////////////////////////////////////////////
+// Coroutine-local storage.
+//////////////////////////////////////////////////////////////////
+
+/**
+ * The keys are common for all the engines, like the thread keys.
+ * The values are in the coroutines, so the access is just an index.
+ */
+static pthread_mutex_t coro_key_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool coro_key_is_used[CORO_KEY_COUNT];
+/** Value destructors, per key. Can be NULL. */
+static void (*coro_key_destructors[CORO_KEY_COUNT])(void *);
+/**
+ * Generations of the keys, bumped on each create and delete. The
+ * values of the previous generations read as NULL.
+ */
+static unsigned coro_key_generations[CORO_KEY_COUNT];
+/** Values of the code running outside of the coroutines. */
+static __thread struct coro_specific coro_thread_specific[CORO_KEY_COUNT];
+
+/** Values of the current coroutine, or of the thread if none. */
+static inline struct coro_specific *
+coro_specific_cur(void)
+{
+	struct coro_engine *engine = cur_coro_engine;
+	if (engine == NULL || engine->this_coro == NULL ||
+	    engine->this_coro == &engine->sched)
+		return coro_thread_specific;
+	return engine->this_coro->specific;
+}
+
+/** Destroy the values of a finished coroutine before its reuse. */
+static void
+coro_specific_destroy(struct coro *c)
+{
+	for (int i = 0; i < CORO_KEY_COUNT; ++i) {
+		struct coro_specific *specific = &c->specific[i];
+		void *value = specific->value;
+		if (value == NULL)
+			continue;
+		specific->value = NULL;
+		void (*destructor)(void *) = __atomic_load_n(
+			&coro_key_destructors[i], __ATOMIC_ACQUIRE);
+		/* A value of a deleted key isn't the new key's one. */
+		if (specific->generation != __atomic_load_n(
+			&coro_key_generations[i], __ATOMIC_ACQUIRE))
+			continue;
+		if (destructor != NULL)
+			destructor(value);
+	}
+}
+
+//////////////////////////////////////////////////////////////////
+
+static void *
+coro_engine_join(struct coro_engine *engine, struct coro *coro)
+{
+	struct coro *this_coro = engine->this_coro;
+	assert(coro->joiner == NULL);
+	/*
+	 * The joiner is published before the state check, and the
+	 * finished state before the joiner check in the worker. So
+	 * either the joiner sees the end, or gets woken up.
+	 */
+	__atomic_store_n(&coro->joiner, this_coro, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&coro->state, __ATOMIC_SEQ_CST) !=
+	       CORO_STATE_FINISHED) {
+		coro_engine_suspend(engine);
+		engine = coro_engine_cur();
+	}
+	assert(coro->joiner == this_coro);
+	coro->joiner = NULL;
+	void *ret = coro->ret;
+	coro->ret = NULL;
+	coro_specific_destroy(coro);
+	coro_engine_recycle(engine, coro);
+	return ret;
+}
+
+//////////////////////////////////////////////////////////////////
+// Groups.
+//////////////////////////////////////////////////////////////////
+
+static struct coro *
+coro_engine_group_wait_any(struct coro_engine *engine,
+	struct coro_group *group)
+{
+	struct coro *this_coro = engine->this_coro;
+	pthread_mutex_lock(&group->mutex);
+	assert(group->waiter == NULL);
+	/*
+	 * The waiter is published under the lock, so a member
+	 * finishing right after the unlock wakes it up.
+	 */
+	while (rlist_empty(&group->finished)) {
+		if (rlist_empty(&group->members)) {
+			pthread_mutex_unlock(&group->mutex);
+			return NULL;
+		}
+		group->waiter = this_coro;
+		pthread_mutex_unlock(&group->mutex);
+		coro_engine_suspend(engine);
+		engine = coro_engine_cur();
+		pthread_mutex_lock(&group->mutex);
+		group->waiter = NULL;
+	}
+	struct coro *c = rlist_shift_entry(&group->finished, struct coro,
+		in_group);
+	pthread_mutex_unlock(&group->mutex);
+	c->group = NULL;
+	return c;
+}
+
+static void
+coro_group_cancel_impl(struct coro_group *group)
+{
+	pthread_mutex_lock(&group->mutex);
+	group->is_cancelled = true;
+	struct coro *c;
+	rlist_foreach_entry(c, &group->members, in_group)
+		coro_engine_cancel(c);
+	pthread_mutex_unlock(&group->mutex);
+}
+
+//////////////////////////////////////////////////////////////////
+// Worker pool.
+//////////////////////////////////////////////////////////////////
+
+/**
+ * Make the coroutines runnable by this worker in the last round
+ * available for taking and stealing. They are pushed in reverse,
+ * so the owner takes them in the order they became runnable, and
+ * the thieves steal the ones which would run last. The higher
+ * priorities go first, but there is no weighting - each round runs
+ * all of them anyway. Returns false if there is nothing to run.
+ */
+static bool
+coro_worker_refill(struct coro_worker *w)
+{
+	struct coro_worker_pool *pool = w->pool;
+	struct coro_engine *engine = w->engine;
+	coro_engine_process_timers(engine);
+	coro_engine_poll(engine, 0);
+	if (__atomic_load_n(&pool->inject_count, __ATOMIC_RELAXED) > 0) {
+		struct rlist inject;
+		rlist_create(&inject);
+		pthread_mutex_lock(&pool->mutex);
+		rlist_splice_tail(&inject, &pool->inject);
+		pool->inject_count = 0;
+		pthread_mutex_unlock(&pool->mutex);
+		while (!rlist_empty(&inject)) {
+			coro_engine_push(engine, rlist_shift_entry(&inject,
+				struct coro, link));
+		}
+	}
+	int count = 0;
+	for (int i = CORO_PRIO_COUNT - 1; i >= 0; --i) {
+		struct rlist *queue = &engine->run_queue[i];
+		while (!rlist_empty(queue)) {
+			struct coro *c = rlist_shift_tail_entry(queue,
+				struct coro, link);
+			coro_deque_push(&w->deque, c);
+			++count;
+		}
+	}
+	engine->run_count = 0;
+	if (count > 1)
+		coro_worker_pool_notify(pool);
+	return count > 0;
+}
+
+static struct coro *
+coro_worker_steal(struct coro_worker *w)
+{
+	struct coro_worker_pool *pool = w->pool;
+	int count = pool->worker_count;
+	w->rand = w->rand * 1103515245 + 12345;
+	int start = (w->rand >> 16) % count;
+	for (int i = 0; i < count; ++i) {
+		struct coro_worker *victim = &pool->workers[(start + i) % count];
+		if (victim == w)
+			continue;
+		struct coro *c = coro_deque_steal(&victim->deque);
+		if (c != NULL)
+			return c;
 	}
-	assert(new_coro_engine == NULL);
-	engine->this_coro = old_this;
+	return NULL;
+}
+
+/** Check if any other worker has coroutines to steal. */
+static bool
+coro_worker_has_work(struct coro_worker *w)
+{
+	struct coro_worker_pool *pool = w->pool;
+	for (int i = 0; i < pool->worker_count; ++i) {
+		struct coro_deque *deque = &pool->workers[i].deque;
+		if (deque == &w->deque)
+			continue;
+		int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST) > top)
+			return true;
+	}
+	return false;
+}
 
+/**
+ * Sleep until there might be some work. The worker sleeps in its
+ * epoll, so its I/O waits wake it up, as well as its nearest timer
+ * and a poke of the eventfd by coro_worker_pool_notify(). Returns
+ * false when all the workers are idle and all the coroutines are
+ * finished, so the run is over.
+ */
+static bool
+coro_worker_wait(struct coro_worker *w)
+{
+	struct coro_worker_pool *pool = w->pool;
+	struct coro_engine *engine = w->engine;
+	int timeout_ms = -1;
+	uint64_t deadline = coro_engine_timer_deadline(engine);
+	if (deadline != UINT64_MAX) {
+		uint64_t now = coro_clock_ns();
+		if (deadline <= now)
+			return true;
+		/* Round up to not wake up before the timer. */
+		uint64_t timeout = (deadline - now + 999999) / 1000000;
+		timeout_ms = timeout > INT32_MAX ? INT32_MAX : timeout;
+	}
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->is_done || !rlist_empty(&pool->inject)) {
+		bool is_done = pool->is_done;
+		pthread_mutex_unlock(&pool->mutex);
+		return !is_done;
+	}
+	__atomic_store_n(&engine->is_sleeping, true, __ATOMIC_SEQ_CST);
+	int idle_count = __atomic_add_fetch(&pool->idle_count, 1,
+		__ATOMIC_SEQ_CST);
+	if (idle_count == pool->worker_count &&
+	    __atomic_load_n(&pool->active_count, __ATOMIC_ACQUIRE) == 0) {
+		pool->is_done = true;
+		for (int i = 0; i < pool->worker_count; ++i) {
+			struct coro_engine *e = pool->workers[i].engine;
+			if (__atomic_exchange_n(&e->is_sleeping, false,
+						__ATOMIC_SEQ_CST))
+				coro_engine_poke(e);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
 	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
+	 * The work published before the flag is seen here, the
+	 * later one comes with a poke.
 	 */
-	if (sigaltstack(NULL, &newst) != 0)
-		handle_error();
-	newst.ss_flags = SS_DISABLE;
-	if (sigaltstack(&newst, NULL) != 0)
-		handle_error();
-	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-	    sigaltstack(&oldst, NULL) != 0)
-		handle_error();
-	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
-		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
-		handle_error();
-
-	/* Now scheduler can work with that coroutine. */
-	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&engine->is_sleeping, __ATOMIC_SEQ_CST) &&
+	    !coro_worker_has_work(w))
+		coro_engine_poll(engine, timeout_ms);
+	__atomic_store_n(&engine->is_sleeping, false, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&pool->mutex);
+	__atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_SEQ_CST);
+	bool is_done = pool->is_done;
+	pthread_mutex_unlock(&pool->mutex);
+	return !is_done;
 }
 
-static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
+/** Run the coroutine until it switches back, and handle its action. */
+static void
+coro_worker_resume(struct coro_worker *w, struct coro *c)
 {
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
+	struct coro_engine *engine = w->engine;
+	assert(engine->this_coro == NULL);
+	if (engine->is_stats_enabled)
+		coro_engine_stats_switch(engine, &engine->sched, c);
+	coro_switch(&engine->sched, c);
+	if (engine->is_stats_enabled)
+		coro_engine_stats_switch(engine, c, &engine->sched);
+	assert(engine->this_coro == NULL);
+	enum coro_state state;
+	struct coro *joiner;
+	switch (w->action) {
+	case CORO_WORKER_YIELD:
+		coro_engine_push(engine, c);
+		break;
+	case CORO_WORKER_PARK:
+		state = CORO_STATE_PARKING;
+		if (!__atomic_compare_exchange_n(&c->state, &state,
+						 CORO_STATE_SUSPENDED, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_SEQ_CST)) {
+			/* Woken up while was switching out. */
+			assert(state == CORO_STATE_RUNNING);
+			coro_engine_push(engine, c);
+		}
+		break;
+	case CORO_WORKER_FINISH:
+		__atomic_sub_fetch(&w->pool->active_count, 1,
+			__ATOMIC_RELEASE);
+		__atomic_store_n(&c->state, CORO_STATE_FINISHED,
+			__ATOMIC_SEQ_CST);
+		joiner = __atomic_load_n(&c->joiner, __ATOMIC_SEQ_CST);
+		if (joiner != NULL)
+			coro_worker_wakeup(joiner);
+		break;
+	}
+}
 
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->state = CORO_STATE_RUNNING;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+static void
+coro_worker_run(struct coro_worker *w)
+{
+	/* The first worker runs in the thread owning the pool. */
+	struct coro_engine *prev = cur_coro_engine;
+	assert(prev == NULL || prev == w->engine);
+	cur_coro_engine = w->engine;
+	while (true) {
+		struct coro *c = coro_deque_take(&w->deque);
+		if (c == NULL && coro_worker_refill(w))
+			continue;
+		if (c == NULL)
+			c = coro_worker_steal(w);
+		if (c == NULL) {
+			if (!coro_worker_wait(w))
+				break;
+			continue;
+		}
+		coro_worker_resume(w, c);
+	}
+	cur_coro_engine = prev;
 }
 
 static void *
-coro_engine_join(struct coro_engine *engine, struct coro *coro)
+coro_worker_thread_f(void *arg)
 {
-	assert(coro->joiner == NULL);
-	coro->joiner = engine->this_coro;
-	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
-	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this_coro);
-	coro->joiner = NULL;
-	void *ret = coro->ret;
-	coro->ret = NULL;
-	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
-	return ret;
+	coro_worker_run((struct coro_worker *)arg);
+	return NULL;
+}
+
+/**
+ * Create a pool of workers, the first of which is the given engine.
+ * The others get new engines and run in own threads.
+ */
+static void
+coro_worker_pool_create(struct coro_engine *engine, int worker_count)
+{
+	assert(engine->worker == NULL);
+	assert(worker_count > 0);
+	struct coro_worker_pool *pool = new coro_worker_pool();
+	pool->workers = new coro_worker[worker_count];
+	pool->worker_count = worker_count;
+	rlist_create(&pool->inject);
+	pool->inject_count = 0;
+	pool->idle_count = 0;
+	pool->active_count = 0;
+	pool->is_done = false;
+	pool->coro_count = 0;
+	pthread_mutex_init(&pool->mutex, NULL);
+	for (int i = 0; i < worker_count; ++i) {
+		struct coro_worker *w = &pool->workers[i];
+		if (i == 0) {
+			w->engine = engine;
+		} else {
+			w->engine = new coro_engine();
+			coro_engine_create(w->engine);
+		}
+		w->engine->worker = w;
+		w->pool = pool;
+		/* The idle worker sleeps in the epoll. */
+		coro_engine_event_fd_open(w->engine);
+		coro_deque_create(&w->deque);
+		w->action = CORO_WORKER_YIELD;
+		w->rand = i + 1;
+	}
+}
+
+static void
+coro_worker_pool_run(struct coro_worker_pool *pool)
+{
+	pool->is_done = false;
+	pool->idle_count = 0;
+	for (int i = 1; i < pool->worker_count; ++i) {
+		struct coro_worker *w = &pool->workers[i];
+		if (pthread_create(&w->thread, NULL, coro_worker_thread_f,
+				   w) != 0)
+			handle_error();
+	}
+	coro_worker_run(&pool->workers[0]);
+	for (int i = 1; i < pool->worker_count; ++i)
+		pthread_join(pool->workers[i].thread, NULL);
+}
+
+static void
+coro_worker_pool_destroy(struct coro_worker_pool *pool)
+{
+	assert(rlist_empty(&pool->inject));
+	for (int i = 0; i < pool->worker_count; ++i) {
+		struct coro_worker *w = &pool->workers[i];
+		coro_deque_destroy(&w->deque);
+		coro_engine_destroy(w->engine);
+		if (i > 0)
+			delete w->engine;
+	}
+	assert(pool->coro_count == 0);
+	pthread_mutex_destroy(&pool->mutex);
+	delete[] pool->workers;
+	delete pool;
 }
 
 //////////////////////////////////////////////////////////////////
 
-static struct coro_engine glob_engine;
+struct coro_engine *
+coro_engine_new(void)
+{
+	struct coro_engine *engine = new coro_engine();
+	coro_engine_create(engine);
+	return engine;
+}
+
+void
+coro_engine_delete(struct coro_engine *engine)
+{
+	/* The other workers' engines are deleted by their pool. */
+	assert(engine->worker == NULL ||
+	       engine == engine->worker->pool->workers[0].engine);
+	if (cur_coro_engine == engine)
+		cur_coro_engine = NULL;
+	if (engine->worker != NULL)
+		coro_worker_pool_destroy(engine->worker->pool);
+	else
+		coro_engine_destroy(engine);
+	delete engine;
+}
+
+struct coro_engine *
+coro_engine_current(void)
+{
+	return cur_coro_engine;
+}
+
+void
+coro_engine_set_current(struct coro_engine *engine)
+{
+	assert(cur_coro_engine == NULL || cur_coro_engine->this_coro == NULL);
+	cur_coro_engine = engine;
+}
 
 void
 coro_sched_init(void)
 {
-	coro_engine_create(&glob_engine);
+	assert(cur_coro_engine == NULL);
+	cur_coro_engine = coro_engine_new();
+}
+
+void
+coro_sched_init_workers(int worker_count)
+{
+	coro_sched_init();
+	coro_worker_pool_create(cur_coro_engine, worker_count);
 }
 
 void
 coro_sched_run(void)
 {
-	coro_engine_run(&glob_engine);
+	struct coro_engine *engine = coro_engine_cur();
+	if (engine->worker != NULL)
+		coro_worker_pool_run(engine->worker->pool);
+	else
+		coro_engine_run(engine);
 }
 
 void
 coro_sched_destroy(void)
 {
-	coro_engine_destroy(&glob_engine);
+	coro_engine_delete(coro_engine_cur());
+}
+
+/**
+ * Number of the engines in the scheduler of the engine. More than
+ * one if it is a worker pool.
+ */
+static int
+coro_sched_engine_count(struct coro_engine *engine)
+{
+	if (engine->worker == NULL)
+		return 1;
+	return engine->worker->pool->worker_count;
+}
+
+static struct coro_engine *
+coro_sched_engine_at(struct coro_engine *engine, int i)
+{
+	if (engine->worker == NULL)
+		return engine;
+	return engine->worker->pool->workers[i].engine;
+}
+
+void
+coro_sched_pool_config(size_t hot_count, size_t max_count, size_t keep_size)
+{
+	assert(hot_count <= max_count);
+	struct coro_engine *engine = coro_engine_cur();
+	int count = coro_sched_engine_count(engine);
+	for (int i = 0; i < count; ++i) {
+		struct coro_engine *e = coro_sched_engine_at(engine, i);
+		e->pool_hot_count = hot_count;
+		e->pool_max_count = max_count;
+		e->pool_keep_size = keep_size;
+	}
+}
+
+void
+coro_sched_pool_stats(struct coro_pool_stats *stats)
+{
+	struct coro_engine *engine = coro_engine_cur();
+	memset(stats, 0, sizeof(*stats));
+	int count = coro_sched_engine_count(engine);
+	for (int i = 0; i < count; ++i) {
+		const struct coro_pool_stats *s =
+			&coro_sched_engine_at(engine, i)->pool_stats;
+		stats->hit_count += s->hit_count;
+		stats->miss_count += s->miss_count;
+		stats->trim_count += s->trim_count;
+		stats->free_count += s->free_count;
+		stats->idle_count += s->idle_count;
+		if (s->stack_hwm > stats->stack_hwm)
+			stats->stack_hwm = s->stack_hwm;
+	}
+}
+
+void
+coro_sched_stats_enable(bool is_enabled)
+{
+	struct coro_engine *engine = coro_engine_cur();
+	int count = coro_sched_engine_count(engine);
+	for (int i = 0; i < count; ++i)
+		coro_sched_engine_at(engine, i)->is_stats_enabled = is_enabled;
+}
+
+void
+coro_get_stats(struct coro *coro, struct coro_stats *stats)
+{
+	*stats = coro->stats;
+}
+
+void
+coro_sched_dump(FILE *out)
+{
+	struct coro_engine *engine = coro_engine_cur();
+	int count = coro_sched_engine_count(engine);
+	for (int i = 0; i < count; ++i)
+		coro_engine_dump(coro_sched_engine_at(engine, i), out);
+}
+
+void
+coro_sched_trace_start(size_t event_count)
+{
+	assert(event_count > 0);
+	struct coro_engine *engine = coro_engine_cur();
+	uint64_t now = coro_clock_ns();
+	int count = coro_sched_engine_count(engine);
+	for (int i = 0; i < count; ++i) {
+		struct coro_engine *e = coro_sched_engine_at(engine, i);
+		delete[] e->trace;
+		e->trace = new coro_trace_event[event_count];
+		e->trace_size = event_count;
+		e->trace_count = 0;
+		e->trace_start_ns = now;
+		e->is_stats_enabled = true;
+	}
+}
+
+void
+coro_sched_trace_stop(void)
+{
+	struct coro_engine *engine = coro_engine_cur();
+	int count = coro_sched_engine_count(engine);
+	for (int i = 0; i < count; ++i) {
+		struct coro_engine *e = coro_sched_engine_at(engine, i);
+		delete[] e->trace;
+		e->trace = NULL;
+		e->trace_size = 0;
+		e->trace_count = 0;
+	}
+}
+
+int
+coro_sched_trace_export(FILE *out)
+{
+	struct coro_engine *engine = coro_engine_cur();
+	fprintf(out, "{\"traceEvents\":[\n");
+	int count = coro_sched_engine_count(engine);
+	for (int i = 0; i < count; ++i) {
+		if (i > 0)
+			fprintf(out, ",\n");
+		coro_engine_trace_export(coro_sched_engine_at(engine, i), i,
+			out);
+	}
+	fprintf(out, "\n]}\n");
+	return ferror(out) ? -1 : 0;
 }
 
 struct coro *
 coro_this(void)
 {
-	return glob_engine.this_coro;
+	return coro_engine_cur()->this_coro;
 }
 
 struct coro *
 coro_new(coro_f func, void *func_arg)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	return coro_engine_spawn(coro_engine_cur(), func, func_arg, 0,
+		CORO_PRIO_NORMAL, NULL);
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size)
+{
+	return coro_engine_spawn(coro_engine_cur(), func, func_arg,
+		stack_size, CORO_PRIO_NORMAL, NULL);
+}
+
+struct coro *
+coro_new_prio(coro_f func, void *func_arg, enum coro_prio prio)
+{
+	assert(prio >= 0 && prio < CORO_PRIO_COUNT);
+	return coro_engine_spawn(coro_engine_cur(), func, func_arg, 0,
+		prio, NULL);
+}
+
+void
+coro_set_prio(struct coro *coro, enum coro_prio prio)
+{
+	assert(prio >= 0 && prio < CORO_PRIO_COUNT);
+	struct coro_engine *engine = coro->engine;
+	if (engine->worker != NULL) {
+		/* Applies when the coroutine is queued next time. */
+		__atomic_store_n(&coro->prio, prio, __ATOMIC_RELAXED);
+		return;
+	}
+	bool is_queued = coro->state == CORO_STATE_RUNNING &&
+		!rlist_empty(&coro->link);
+	coro->prio = prio;
+	if (is_queued) {
+		rlist_del_entry(coro, link);
+		rlist_add_tail_entry(&engine->run_queue[prio], coro, link);
+	}
+}
+
+enum coro_prio
+coro_get_prio(struct coro *coro)
+{
+	return __atomic_load_n(&coro->prio, __ATOMIC_RELAXED);
 }
 
 void *
 coro_join(struct coro *coro)
 {
-	return coro_engine_join(&glob_engine, coro);
+	return coro_engine_join(coro_engine_cur(), coro);
 }
 
 void
 coro_suspend(void)
 {
-	coro_engine_suspend(&glob_engine);
+	coro_engine_suspend(coro_engine_cur());
 }
 
 void
 coro_yield(void)
 {
-	coro_engine_yield(&glob_engine);
+	coro_engine_yield(coro_engine_cur());
 }
 
 void
 coro_wakeup(struct coro *coro)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	coro_engine_wakeup(coro->engine, coro);
+}
+
+void
+coro_sleep(uint64_t timeout_ns)
+{
+	coro_engine_sleep(coro_engine_cur(), timeout_ns);
+}
+
+bool
+coro_suspend_timeout(uint64_t timeout_ns)
+{
+	return coro_engine_suspend_timeout(coro_engine_cur(), timeout_ns);
+}
+
+int
+coro_wait_fd(int fd, int events, uint64_t timeout_ns)
+{
+	return coro_engine_wait_fd(coro_engine_cur(), fd, events,
+		timeout_ns);
+}
+
+/**
+ * Check if a failed I/O call should be retried. When it would
+ * block, the coroutine waits for the descriptor to become ready.
+ */
+static bool
+coro_io_retry(int fd, int events)
+{
+	if (errno == EINTR)
+		return true;
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return false;
+	return coro_wait_fd(fd, events, UINT64_MAX) >= 0;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	ssize_t rc;
+	while ((rc = read(fd, buf, size)) < 0 &&
+	       coro_io_retry(fd, CORO_EVENT_READ))
+		;
+	return rc;
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	ssize_t rc;
+	while ((rc = write(fd, buf, size)) < 0 &&
+	       coro_io_retry(fd, CORO_EVENT_WRITE))
+		;
+	return rc;
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+	int rc;
+	while ((rc = accept4(fd, addr, addr_len,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0 &&
+	       coro_io_retry(fd, CORO_EVENT_READ))
+		;
+	return rc;
+}
+
+void
+coro_cancel(struct coro *coro)
+{
+	coro_engine_cancel(coro);
+}
+
+bool
+coro_is_cancelled(void)
+{
+	struct coro *c = coro_engine_cur()->this_coro;
+	return c != NULL && coro_is_cancelled_impl(c);
+}
+
+struct coro_group *
+coro_group_new(void)
+{
+	struct coro_group *group = new coro_group();
+	pthread_mutex_init(&group->mutex, NULL);
+	rlist_create(&group->members);
+	rlist_create(&group->finished);
+	group->waiter = NULL;
+	group->is_cancelled = false;
+	return group;
+}
+
+void
+coro_group_delete(struct coro_group *group)
+{
+	assert(rlist_empty(&group->members));
+	assert(rlist_empty(&group->finished));
+	assert(group->waiter == NULL);
+	pthread_mutex_destroy(&group->mutex);
+	delete group;
+}
+
+struct coro *
+coro_group_spawn(struct coro_group *group, coro_f func, void *func_arg)
+{
+	return coro_engine_spawn(coro_engine_cur(), func, func_arg, 0,
+		CORO_PRIO_NORMAL, group);
+}
+
+struct coro *
+coro_group_wait_any(struct coro_group *group)
+{
+	return coro_engine_group_wait_any(coro_engine_cur(), group);
+}
+
+void
+coro_group_join(struct coro_group *group)
+{
+	struct coro *c;
+	while ((c = coro_group_wait_any(group)) != NULL)
+		coro_join(c);
+}
+
+void
+coro_group_cancel(struct coro_group *group)
+{
+	coro_group_cancel_impl(group);
+}
+
+void
+coro_remote_start(struct coro_remote *remote)
+{
+	coro_engine_remote_start(coro_engine_cur(), remote);
+}
+
+void
+coro_remote_wait(struct coro_remote *remote)
+{
+	coro_engine_remote_wait(coro_engine_cur(), remote);
+}
+
+void
+coro_remote_signal(struct coro_remote *remote)
+{
+	coro_engine_remote_signal(remote);
+}
+
+void
+coro_remote_cancel(struct coro_remote *remote)
+{
+	coro_engine_remote_cancel(remote);
+}
+
+int
+coro_key_create(coro_key_t *key, void (*destructor)(void *))
+{
+	pthread_mutex_lock(&coro_key_mutex);
+	for (int i = 0; i < CORO_KEY_COUNT; ++i) {
+		if (coro_key_is_used[i])
+			continue;
+		coro_key_is_used[i] = true;
+		__atomic_store_n(&coro_key_destructors[i], destructor,
+			__ATOMIC_RELEASE);
+		__atomic_store_n(&coro_key_generations[i],
+			coro_key_generations[i] + 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&coro_key_mutex);
+		*key = i;
+		return 0;
+	}
+	pthread_mutex_unlock(&coro_key_mutex);
+	return -1;
+}
+
+void
+coro_key_delete(coro_key_t key)
+{
+	assert(key < CORO_KEY_COUNT);
+	pthread_mutex_lock(&coro_key_mutex);
+	assert(coro_key_is_used[key]);
+	coro_key_is_used[key] = false;
+	__atomic_store_n(&coro_key_destructors[key], NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&coro_key_generations[key],
+		coro_key_generations[key] + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&coro_key_mutex);
+}
+
+void *
+coro_getspecific(coro_key_t key)
+{
+	assert(key < CORO_KEY_COUNT);
+	const struct coro_specific *specific = &coro_specific_cur()[key];
+	if (specific->generation != __atomic_load_n(
+		&coro_key_generations[key], __ATOMIC_ACQUIRE))
+		return NULL;
+	return specific->value;
+}
+
+void
+coro_setspecific(coro_key_t key, void *value)
+{
+	assert(key < CORO_KEY_COUNT);
+	struct coro_specific *specific = &coro_specific_cur()[key];
+	specific->value = value;
+	specific->generation = __atomic_load_n(&coro_key_generations[key],
+		__ATOMIC_ACQUIRE);
 }
@@ -1,28 +1,211 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
 struct coro;
+struct coro_engine;
+struct coro_group;
 typedef void *(*coro_f)(void *);
 
-/** Initialize the coroutines engine. */
+/** Coroutine priority classes. */
+enum coro_prio {
+	/** Latency-critical work, like heartbeats or request handlers. */
+	CORO_PRIO_HIGH,
+	/** The default one. */
+	CORO_PRIO_NORMAL,
+	/** Bulk work, which can wait. */
+	CORO_PRIO_BACKGROUND,
+	CORO_PRIO_COUNT,
+};
+
+/**
+ * Create a coroutines engine. Each engine is an independent
+ * scheduler with own coroutines, pool, timers and epoll. An engine
+ * is used by the thread it is current in, see
+ * coro_engine_set_current(). So a thread-per-core application can
+ * run an engine per thread without any shared state.
+ */
+struct coro_engine *
+coro_engine_new(void);
+
+/**
+ * Delete an engine. All its coros must be finished by now. A worker
+ * pool is deleted only via its first engine, the one it was created
+ * in, or via coro_sched_destroy() in that thread. The engines of the
+ * other workers, seen by coro_engine_current() in their coroutines,
+ * must not be deleted.
+ */
+void
+coro_engine_delete(struct coro_engine *engine);
+
+/** Get the engine of the calling thread. NULL if there is none. */
+struct coro_engine *
+coro_engine_current(void);
+
+/**
+ * Make the engine current in the calling thread. All the functions
+ * below work with the current engine. An engine can be moved to
+ * another thread when it is not running.
+ */
+void
+coro_engine_set_current(struct coro_engine *engine);
+
+/**
+ * Initialize the coroutines engine of the calling thread. The same
+ * as creating an engine and making it current.
+ */
 void
 coro_sched_init(void);
 
 /**
- * Run the coroutines processing while there are any runnable
- * ones.
+ * Initialize the coroutines engine with a pool of worker threads.
+ * coro_sched_run() then runs the coroutines on @a worker_count
+ * threads, including the calling one. Each worker has own queue of
+ * runnable coroutines, and the idle workers steal from the others.
+ * So a coroutine can continue on another thread after any switch.
+ *
+ * coro_sched_run() returns only when all the coroutines are
+ * finished, since a suspended one can be woken up by a thread not
+ * belonging to the pool.
+ *
+ * coro_wakeup() can be called from any thread. A wakeup of a
+ * running coroutine is not lost, but makes its next suspension
+ * return right away. Hence the suspensions should be done in a
+ * loop checking the awaited condition. The coroutines sharing data
+ * must synchronize the access themselves.
+ *
+ * Each worker has own timers and epoll instance. An idle worker
+ * sleeps in its epoll until an event, its nearest timer, or new
+ * work for it to steal.
+ *
+ * The pool of the joined coroutines is kept per worker. The object
+ * of a coroutine freed beyond the pool size stays allocated until
+ * coro_sched_destroy(), but its stack is freed.
+ */
+void
+coro_sched_init_workers(int worker_count);
+
+/**
+ * Run the coroutines processing while there are any runnable or
+ * sleeping ones, or ones waiting for I/O. When all the coroutines
+ * are waiting, the thread sleeps until an event or the nearest
+ * timer.
  */
 void
 coro_sched_run(void);
 
 /**
- * Destroy the coroutines engine. All coros must be finished by
- * now.
+ * Destroy the coroutines engine of the calling thread. All coros
+ * must be finished by now.
  */
 void
 coro_sched_destroy(void);
 
+/** Counters of the pool of the joined coroutines. */
+struct coro_pool_stats {
+	/** Coroutines created with a stack taken from the pool. */
+	size_t hit_count;
+	/** Coroutines which had to allocate a new stack. */
+	size_t miss_count;
+	/** Pooled stacks which got their pages released. */
+	size_t trim_count;
+	/** Joined coroutines freed because the pool was full. */
+	size_t free_count;
+	/** Coroutines in the pool right now. */
+	size_t idle_count;
+	/**
+	 * The deepest stack usage among the joined coroutines, in
+	 * whole pages. The ones kept hot are counted only while the
+	 * scheduler stats are enabled.
+	 */
+	size_t stack_hwm;
+};
+
+/**
+ * Configure the pool of the joined coroutines. They are reused by
+ * the new coroutines.
+ * @param hot_count How many joined coroutines are kept with their
+ *     stacks untouched.
+ * @param max_count How many joined coroutines are kept at all. The
+ *     ones beyond @a hot_count get their stack memory released
+ *     except for the top @a keep_size bytes. The ones beyond
+ *     @a max_count are freed.
+ * @param keep_size How much of a stack stays committed after a
+ *     trim.
+ */
+void
+coro_sched_pool_config(size_t hot_count, size_t max_count, size_t keep_size);
+
+/** Get the counters of the pool of the joined coroutines. */
+void
+coro_sched_pool_stats(struct coro_pool_stats *stats);
+
+/** Scheduling counters of a coroutine. */
+struct coro_stats {
+	/** How many times the coroutine got the CPU. */
+	uint64_t switch_count;
+	/** Total time on the CPU. */
+	uint64_t run_ns;
+	/** The longest time on the CPU without a switch. */
+	uint64_t run_max_ns;
+	/** Total time from becoming runnable till getting the CPU. */
+	uint64_t wait_ns;
+	/** The longest wait from becoming runnable till running. */
+	uint64_t wait_max_ns;
+};
+
+/**
+ * Enable or disable the scheduling counters in the current engine,
+ * all workers of a pool included. They are off by default, and
+ * cost nothing then. When on, each switch reads the clock.
+ */
+void
+coro_sched_stats_enable(bool is_enabled);
+
+/**
+ * Get the scheduling counters of a coroutine. They are reset when
+ * the coroutine is created. In a worker pool they are updated by
+ * the workers without synchronization, so are approximate while
+ * the coroutine runs.
+ */
+void
+coro_get_stats(struct coro *coro, struct coro_stats *stats);
+
+/**
+ * Print the state of the current engine: the queues, the pool,
+ * the timers, and all its coroutines with their counters. Should
+ * be called from the engine's thread or when it is not running.
+ */
+void
+coro_sched_dump(FILE *out);
+
+/**
+ * Start recording the coroutine runs in the current engine. The
+ * last @a event_count runs of each worker are kept. Enables the
+ * scheduling counters while recording.
+ */
+void
+coro_sched_trace_start(size_t event_count);
+
+/** Stop recording and drop the recorded runs. */
+void
+coro_sched_trace_stop(void);
+
+/**
+ * Write the recorded runs in the Chrome trace event JSON format,
+ * which can be opened in chrome://tracing or Perfetto. Each worker
+ * is a thread there, each run is a slice named by its coroutine.
+ * @retval 0 Success.
+ * @retval -1 Write error.
+ */
+int
+coro_sched_trace_export(FILE *out);
+
 /** Get the currently working coroutine. */
 struct coro *
 coro_this(void);
@@ -34,10 +217,55 @@ coro_this(void);
  *
  * Whatever the callback function returns, will be returned from
  * coro_join().
+ *
+ * Returns NULL if the stack can't be mapped, errno tells why.
  */
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but the coroutine stack is at least
+ * @a stack_size bytes. 0 means the default size, 1MB. The stack
+ * memory is reserved, but committed only when touched. An overflow
+ * hits a guard page and crashes the process.
+ *
+ * The guard page splits the stack mapping in two, so each not freed
+ * coroutine takes 2 memory mappings. With the default
+ * vm.max_map_count of 65530 that is ~32k coroutines per process,
+ * more need the sysctl raised. Beyond the limit NULL is returned
+ * with errno ENOMEM.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size);
+
+/**
+ * Same as coro_new(), but the coroutine has the given priority.
+ * Each priority has own run queue. When several queues have
+ * runnable coroutines, the switches are shared among them as
+ * 16:4:1 for high:normal:background, interleaved evenly. So the
+ * latency-critical coroutines don't wait behind the bulk ones, and
+ * the background work still progresses.
+ *
+ * In a worker pool the priority only orders the coroutines taken
+ * by a worker at once.
+ */
+struct coro *
+coro_new_prio(coro_f func, void *func_arg, enum coro_prio prio);
+
+/**
+ * Change the priority of a coroutine. If it is runnable already,
+ * it is moved to the new queue.
+ *
+ * In a worker pool an already runnable coroutine keeps its place,
+ * and the new priority applies when it is queued next time.
+ */
+void
+coro_set_prio(struct coro *coro, enum coro_prio prio);
+
+/** Get the priority of a coroutine. */
+enum coro_prio
+coro_get_prio(struct coro *coro);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -54,6 +282,23 @@ coro_join(struct coro *coro);
 void
 coro_suspend(void);
 
+/**
+ * Pause the current coroutine for at least @a timeout_ns
+ * nanoseconds. The wakeups don't interrupt the sleep, but a
+ * cancellation does. The timers have ~65us resolution.
+ */
+void
+coro_sleep(uint64_t timeout_ns);
+
+/**
+ * Same as coro_suspend(), but the coroutine is woken up
+ * automatically when @a timeout_ns nanoseconds pass.
+ * @retval true Woken up before the timeout.
+ * @retval false The timeout has expired.
+ */
+bool
+coro_suspend_timeout(uint64_t timeout_ns);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -65,7 +310,195 @@ coro_yield(void);
 /**
  * Wakeup a coroutine. If it was suspended, then it is going to be
  * continued on the next iteration of the scheduler. Otherwise
- * this function is a nop.
+ * this function is a nop. Must be called in the thread of the
+ * coroutine's engine, unless the engine is a worker pool.
  */
 void
 coro_wakeup(struct coro *coro);
+
+/** Events to wait for on a descriptor. */
+enum {
+	CORO_EVENT_READ = 1,
+	CORO_EVENT_WRITE = 2,
+};
+
+/**
+ * Pause the current coroutine until the descriptor becomes ready
+ * for any of the @a events, or @a timeout_ns nanoseconds pass.
+ * UINT64_MAX means no timeout. While all the coroutines wait, the
+ * scheduler sleeps in epoll_wait(). Many coroutines can wait for
+ * one descriptor, for example a reader and a writer of a socket.
+ * Each is woken up by its own events only.
+ * @return Ready events, 0 on timeout, -1 on error with errno set.
+ *     An error or a hangup on the descriptor is reported as all the
+ *     requested events, so the next I/O call gets the error. A
+ *     cancelled coroutine gets ECANCELED.
+ */
+int
+coro_wait_fd(int fd, int events, uint64_t timeout_ns);
+
+/**
+ * Same as read(2), but a non-blocking descriptor doesn't give
+ * EAGAIN. Instead, the coroutine waits for the data.
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/** Same as write(2), but waits when it would block. */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/**
+ * Same as accept(2), but waits when there are no connections. The
+ * accepted socket is non-blocking.
+ */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addr_len);
+
+/**
+ * Cancel a coroutine. The cancellation is cooperative - it is
+ * delivered at the next suspension point of the coroutine, or
+ * right away if it is suspended. coro_suspend() returns once, so
+ * the coroutine can check coro_is_cancelled(). coro_sleep() returns
+ * early, coro_wait_fd() and the I/O calls fail with ECANCELED,
+ * each time. The waits on the coroutine synchronization primitives
+ * are not interrupted. The same thread rules as for coro_wakeup()
+ * apply.
+ */
+void
+coro_cancel(struct coro *coro);
+
+/** Check if the current coroutine is cancelled. */
+bool
+coro_is_cancelled(void);
+
+/**
+ * Create a group of coroutines. A group owns its members - they are
+ * joined via the group, not one by one. The members don't take any
+ * extra memory. The group must be used in one engine, or in one
+ * worker pool.
+ */
+struct coro_group *
+coro_group_new(void);
+
+/** Delete a group. It must have no members. */
+void
+coro_group_delete(struct coro_group *group);
+
+/**
+ * Same as coro_new(), but the coroutine becomes a member of the
+ * group. A member of a cancelled group starts cancelled.
+ */
+struct coro *
+coro_group_spawn(struct coro_group *group, coro_f func, void *func_arg);
+
+/**
+ * Wait until any member finishes, and take it out of the group. It
+ * still must be joined with coro_join() to get its result. Only one
+ * coroutine can wait for a group at a time.
+ * @return The finished member, or NULL if the group is empty.
+ */
+struct coro *
+coro_group_wait_any(struct coro_group *group);
+
+/**
+ * Wait until all the members finish, and join them. Their results
+ * are dropped.
+ */
+void
+coro_group_join(struct coro_group *group);
+
+/**
+ * Cancel all the members, see coro_cancel(). The members spawned
+ * later start cancelled. Wait for the first result, cancel the rest
+ * and join them - that is the "first result wins" pattern.
+ */
+void
+coro_group_cancel(struct coro_group *group);
+
+/**
+ * A wakeup of a coroutine coming from another thread, like a thread
+ * pool worker which has finished a job for it. Lives on the stack of
+ * the waiting coroutine. The fields are private.
+ */
+struct coro_remote {
+	/** Coroutine to wake up. */
+	struct coro *coro;
+	/** Next request in the inbox of the engine. */
+	struct coro_remote *next;
+	/** The wakeup is delivered. */
+	bool is_done;
+};
+
+/**
+ * Start expecting a remote wakeup for the current coroutine. While
+ * any are expected, the engine doesn't stop when idle, but sleeps
+ * until they come.
+ */
+void
+coro_remote_start(struct coro_remote *remote);
+
+/**
+ * Wait for the remote wakeup started by the current coroutine.
+ * Cancellation doesn't interrupt it - the request must be
+ * delivered before it can be left.
+ */
+void
+coro_remote_wait(struct coro_remote *remote);
+
+/**
+ * Wake up the coroutine waiting for the request. Can be called from
+ * any thread, once per request. Doesn't take locks - the request
+ * goes to a lock-free inbox of the engine, which takes it at the
+ * next iteration. A sleeping engine is woken up via an eventfd.
+ */
+void
+coro_remote_signal(struct coro_remote *remote);
+
+/**
+ * Stop expecting the remote wakeup started by the current
+ * coroutine, when nobody is going to signal it. It is done right
+ * away, so coro_remote_wait() doesn't have to be called.
+ */
+void
+coro_remote_cancel(struct coro_remote *remote);
+
+/** Coroutine-local storage. */
+enum {
+	/** How many keys can exist at once. */
+	CORO_KEY_COUNT = 16,
+};
+
+typedef unsigned coro_key_t;
+
+/**
+ * Create a key for coroutine-local values. The keys are common for
+ * all the engines. Each coroutine has own value for each key,
+ * initially NULL. When a coroutine is joined, its non-NULL values
+ * are passed to the @a destructor, if it is given. The values are
+ * stored right in the coroutines, so the access costs like a field
+ * access, and nothing is allocated.
+ * @retval 0 Success.
+ * @retval -1 All the keys are taken.
+ */
+int
+coro_key_create(coro_key_t *key, void (*destructor)(void *));
+
+/**
+ * Delete a key. The destructor isn't called for the existing
+ * values, but they are gone - a key created later under the same
+ * number starts with NULL everywhere.
+ */
+void
+coro_key_delete(coro_key_t key);
+
+/**
+ * Get the value of the current coroutine for the key. Outside of
+ * the coroutines the values are per thread.
+ */
+void *
+coro_getspecific(coro_key_t key);
+
+/** Set the value of the current coroutine for the key. */
+void
+coro_setspecific(coro_key_t key, void *value);
@@ -0,0 +1,233 @@
+#include "libcoro.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+/*
+ * Micro-benchmarks of the scheduler. Each scenario is run many
+ * times, each run does many operations. The result is nanoseconds
+ * per operation, with min, median, p99 and max among the runs.
+ *
+ * Usage: libcoro_bench [run_count]
+ */
+
+/** Coroutines created and joined per run of a spawn bench. */
+static const int spawn_count = 1000;
+/** Switches per run of the other benches, roughly. */
+static const int switch_count = 100 * 1000;
+/** The smallest stack, to fit many coroutines. */
+static const size_t bench_stack_size = 16 * 1024;
+
+static int run_count = 50;
+
+static uint64_t
+bench_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_report(const char *name, std::vector<double> &times)
+{
+	std::sort(times.begin(), times.end());
+	size_t count = times.size();
+	size_t p99 = count * 99 / 100;
+	if (p99 >= count)
+		p99 = count - 1;
+	printf("%s (ns/op)\n", name);
+	printf("    min: %.1f\n", times[0]);
+	printf("    med: %.1f\n", times[count / 2]);
+	printf("    p99: %.1f\n", times[p99]);
+	printf("    max: %.1f\n", times[count - 1]);
+	fflush(stdout);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_nop_f(void *arg)
+{
+	return arg;
+}
+
+/** Cost of coro_new() + coro_join() of an empty coroutine. */
+static void
+bench_spawn(bool is_pooled)
+{
+	if (is_pooled) {
+		coro_sched_pool_config(64, 1024, 16 * 1024);
+		/* Warm the pool up. */
+		coro_join(coro_new(bench_nop_f, NULL));
+	} else {
+		/* Nothing is kept, each coroutine maps a new stack. */
+		coro_sched_pool_config(0, 0, 0);
+	}
+	std::vector<double> times;
+	for (int run = 0; run < run_count; ++run) {
+		uint64_t start = bench_clock_ns();
+		for (int i = 0; i < spawn_count; ++i)
+			coro_join(coro_new(bench_nop_f, NULL));
+		uint64_t duration = bench_clock_ns() - start;
+		times.push_back((double)duration / spawn_count);
+	}
+	coro_sched_pool_config(64, 1024, 16 * 1024);
+	bench_report(is_pooled ? "spawn+join, pooled" : "spawn+join, cold",
+		times);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_yield_f(void *arg)
+{
+	bool *is_stopped = (bool *)arg;
+	while (!*is_stopped)
+		coro_yield();
+	return NULL;
+}
+
+/**
+ * Cost of a yield, when the given number of coroutines are yielding
+ * in a round-robin. The bench coroutine is one of them, a yield of
+ * it is a full round.
+ */
+static void
+bench_yield(int coro_count)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "yield, %d coros", coro_count);
+	bool is_stopped = false;
+	std::vector<struct coro *> coros;
+	for (int i = 0; i < coro_count - 1; ++i) {
+		struct coro *c = coro_new_ex(bench_yield_f, &is_stopped,
+			bench_stack_size);
+		if (c != NULL) {
+			coros.push_back(c);
+			continue;
+		}
+		/* Each stack takes 2 of the vm.max_map_count mappings. */
+		printf("%s\n    failed: %s after %zu coros\n", name,
+			strerror(errno), coros.size() + 1);
+		is_stopped = true;
+		for (struct coro *started : coros)
+			coro_join(started);
+		return;
+	}
+	/* Let them all start. */
+	coro_yield();
+	int round_count = switch_count / coro_count;
+	if (round_count == 0)
+		round_count = 1;
+	std::vector<double> times;
+	for (int run = 0; run < run_count; ++run) {
+		uint64_t start = bench_clock_ns();
+		for (int i = 0; i < round_count; ++i)
+			coro_yield();
+		uint64_t duration = bench_clock_ns() - start;
+		times.push_back((double)duration / round_count / coro_count);
+	}
+	is_stopped = true;
+	for (struct coro *c : coros)
+		coro_join(c);
+	bench_report(name, times);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_ping_ctx {
+	struct coro *peer;
+	int count;
+	uint64_t duration;
+};
+
+static void *
+bench_ping_f(void *arg)
+{
+	struct bench_ping_ctx *ctx = (struct bench_ping_ctx *)arg;
+	uint64_t start = bench_clock_ns();
+	for (int i = 0; i < ctx->count; ++i) {
+		coro_wakeup(ctx->peer);
+		coro_suspend();
+	}
+	ctx->duration = bench_clock_ns() - start;
+	coro_wakeup(ctx->peer);
+	return NULL;
+}
+
+static void *
+bench_pong_f(void *arg)
+{
+	struct bench_ping_ctx *ctx = (struct bench_ping_ctx *)arg;
+	for (int i = 0; i < ctx->count; ++i) {
+		coro_suspend();
+		coro_wakeup(ctx->peer);
+	}
+	coro_suspend();
+	return NULL;
+}
+
+/**
+ * Cost of a wakeup + a switch, when two coroutines wake each other
+ * up in turns.
+ */
+static void
+bench_ping_pong(void)
+{
+	std::vector<double> times;
+	for (int run = 0; run < run_count; ++run) {
+		struct bench_ping_ctx ping, pong;
+		int count = switch_count / 2;
+		ping.count = count;
+		pong.count = count;
+		struct coro *pong_coro = coro_new(bench_pong_f, &pong);
+		/* Pong is suspended first. */
+		coro_yield();
+		ping.peer = pong_coro;
+		struct coro *ping_coro = coro_new(bench_ping_f, &ping);
+		pong.peer = ping_coro;
+		coro_join(ping_coro);
+		coro_join(pong_coro);
+		times.push_back((double)ping.duration / count / 2);
+	}
+	bench_report("wakeup ping-pong", times);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	bench_spawn(false);
+	bench_spawn(true);
+	for (int count = 1; count <= 100 * 1000; count *= 10)
+		bench_yield(count);
+	bench_ping_pong();
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1) {
+		run_count = atoi(argv[1]);
+		if (run_count <= 0) {
+			printf("Usage: %s [run_count]\n", argv[0]);
+			return -1;
+		}
+	}
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
@@ -1,7 +1,20 @@
 #include "libcoro.h"
+#include "coro_sync.h"
 
 #include "unit.h"
 
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,6 +175,945 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_stack_use(size_t depth)
+{
+	volatile char buf[1024];
+	buf[0] = (char)depth;
+	if (depth > 1)
+		test_stack_use(depth - 1);
+	unit_assert(buf[0] == (char)depth);
+}
+
+static void *
+test_stack_use_f(void *arg)
+{
+	test_stack_use((size_t)arg);
+	return arg;
+}
+
+static void
+test_stack_size(void)
+{
+	unit_test_start();
+
+	unit_msg("a stack is usable almost up to its size");
+	struct coro *c1 = coro_new_ex(test_stack_use_f, (void *)8, 16 * 1024);
+	struct coro *c2 = coro_new_ex(test_stack_use_f, (void *)3000,
+		4 * 1024 * 1024);
+	struct coro *c3 = coro_new_ex(test_stack_use_f, (void *)500, 0);
+	unit_check(coro_join(c1) == (void *)8, "small stack");
+	unit_check(coro_join(c2) == (void *)3000, "big stack");
+	unit_check(coro_join(c3) == (void *)500, "default stack");
+
+	unit_msg("pooled coroutines are reused by stack size");
+	struct coro *c4 = coro_new_ex(test_stack_use_f, (void *)2000,
+		3 * 1024 * 1024);
+	unit_check(c4 == c2, "reused the big stack");
+	struct coro *c5 = coro_new_ex(test_stack_use_f, (void *)10, 10000);
+	unit_check(c5 == c1, "reused the small stack");
+	unit_check(coro_join(c4) == (void *)2000, "big stack again");
+	unit_check(coro_join(c5) == (void *)10, "small stack again");
+
+	unit_msg("a stack which can't be mapped");
+	long vm_pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	unit_assert(f != NULL && fscanf(f, "%ld", &vm_pages) == 1);
+	fclose(f);
+	struct rlimit old_limit, limit;
+	unit_assert(getrlimit(RLIMIT_AS, &old_limit) == 0);
+	limit = old_limit;
+	limit.rlim_cur = vm_pages * sysconf(_SC_PAGESIZE) + 64 * 1024 * 1024;
+	unit_assert(setrlimit(RLIMIT_AS, &limit) == 0);
+	errno = 0;
+	struct coro *c6 = coro_new_ex(test_stack_use_f, NULL,
+		256 * 1024 * 1024);
+	int err = errno;
+	unit_assert(setrlimit(RLIMIT_AS, &old_limit) == 0);
+	unit_check(c6 == NULL && err == ENOMEM, "not created");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** A deep frame with a zeroed buffer, and a frame below it. */
+static void *
+test_stack_zeros_f(void *arg)
+{
+	char buf[1024 * 1024];
+	/* Via a volatile pointer, so the zeroing isn't optimized out. */
+	char *volatile ptr = buf;
+	memset(ptr, 0, sizeof(buf));
+	test_stack_use(4);
+	return ptr[(size_t)arg] == 0 ? arg : NULL;
+}
+
+/** Stack usage of the zeroed frames, in a fresh engine. */
+static void *
+test_stack_zeros_thread_f(void *arg)
+{
+	(void)arg;
+	coro_sched_init();
+	coro_sched_stats_enable(true);
+	struct coro *c = coro_new_ex(test_stack_zeros_f, (void *)10,
+		4 * 1024 * 1024);
+	coro_sched_run();
+	struct coro_pool_stats stats;
+	stats.stack_hwm = 0;
+	if (coro_join(c) == (void *)10)
+		coro_sched_pool_stats(&stats);
+	coro_sched_destroy();
+	return (void *)stats.stack_hwm;
+}
+
+static void
+test_pool_trim(void)
+{
+	unit_test_start();
+
+	struct coro_pool_stats old_stats, stats;
+	coro_sched_pool_stats(&old_stats);
+	size_t idle = old_stats.idle_count;
+	coro_sched_pool_config(idle + 1, idle + 2, 16 * 1024);
+
+	const int coro_count = 4;
+	const size_t stack_size = 8 * 1024 * 1024;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		coros[i] = coro_new_ex(test_stack_use_f, (void *)200,
+			stack_size);
+	}
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == (void *)200);
+	coro_sched_pool_stats(&stats);
+	unit_check(stats.miss_count == old_stats.miss_count + coro_count,
+		"new stacks are allocated");
+	unit_check(stats.trim_count == old_stats.trim_count + 1,
+		"a stack beyond the hot count is trimmed");
+	unit_check(stats.free_count == old_stats.free_count + 2,
+		"stacks beyond the max count are freed");
+	unit_check(stats.idle_count == idle + 2, "pool size is limited");
+	unit_check(stats.stack_hwm >= 200 * 1024, "stack usage is tracked");
+
+	unit_msg("the hot stack is reused first, then the trimmed one");
+	struct coro *c1 = coro_new_ex(test_stack_use_f, (void *)300,
+		stack_size);
+	struct coro *c2 = coro_new_ex(test_stack_use_f, (void *)300,
+		stack_size);
+	unit_assert(c1 == coros[0] && c2 == coros[1]);
+	unit_assert(coro_join(c1) == (void *)300);
+	unit_assert(coro_join(c2) == (void *)300);
+	coro_sched_pool_stats(&stats);
+	unit_check(stats.hit_count == old_stats.hit_count + 2,
+		"pooled stacks are reused");
+
+	unit_msg("zeroed stack pages are counted as used");
+	pthread_t thread;
+	unit_fail_if(pthread_create(&thread, NULL, test_stack_zeros_thread_f,
+		NULL) != 0);
+	void *hwm;
+	pthread_join(thread, &hwm);
+	unit_check((size_t)hwm >= 1024 * 1024 + 4 * 1024,
+		"below a zeroed buffer");
+
+	coro_sched_pool_config(64, 1024, 16 * 1024);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+test_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct test_sleep_ctx {
+	uint64_t timeout;
+	int *order;
+	int *order_pos;
+	int id;
+};
+
+static void *
+test_sleep_f(void *arg)
+{
+	struct test_sleep_ctx *ctx = (decltype(ctx))arg;
+	uint64_t start = test_clock_ns();
+	coro_sleep(ctx->timeout);
+	uint64_t elapsed = test_clock_ns() - start;
+	ctx->order[(*ctx->order_pos)++] = ctx->id;
+	return (void *)(elapsed >= ctx->timeout);
+}
+
+static void *
+test_suspend_timeout_f(void *arg)
+{
+	return (void *)coro_suspend_timeout((uint64_t)arg);
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	unit_msg("sleepers wake up in the deadline order, not earlier");
+	const uint64_t ms = 1000 * 1000;
+	/* The last ones are far enough to be cascaded. */
+	const uint64_t timeouts[] = {3 * ms, 1 * ms, 0, 2 * ms, 300 * ms,
+		70 * ms};
+	const int expected[] = {2, 1, 3, 0, 5, 4};
+	const int count = sizeof(timeouts) / sizeof(timeouts[0]);
+	struct test_sleep_ctx ctx[count];
+	struct coro *coros[count];
+	int order[count];
+	int order_pos = 0;
+	for (int i = 0; i < count; ++i) {
+		ctx[i].timeout = timeouts[i];
+		ctx[i].order = order;
+		ctx[i].order_pos = &order_pos;
+		ctx[i].id = i;
+		coros[i] = coro_new(test_sleep_f, &ctx[i]);
+	}
+	/* The wakeups don't interrupt the sleep. */
+	coro_yield();
+	for (int i = 0; i < count; ++i)
+		coro_wakeup(coros[i]);
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i)
+		is_ok = coro_join(coros[i]) != NULL && is_ok;
+	unit_check(is_ok, "slept enough");
+	is_ok = order_pos == count;
+	for (int i = 0; i < count && is_ok; ++i)
+		is_ok = order[i] == expected[i];
+	unit_check(is_ok, "order");
+
+	unit_msg("suspend with a timeout");
+	uint64_t start = test_clock_ns();
+	struct coro *c = coro_new(test_suspend_timeout_f, (void *)(2 * ms));
+	unit_check(coro_join(c) == (void *)false, "timed out");
+	unit_check(test_clock_ns() - start >= 2 * ms, "waited");
+	c = coro_new(test_suspend_timeout_f, (void *)(1000 * ms));
+	coro_yield();
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)true, "woken up");
+	unit_check(test_clock_ns() - start < 1000 * ms, "didn't wait");
+	c = coro_new(test_suspend_timeout_f, (void *)UINT64_MAX);
+	coro_yield();
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)true, "infinite timeout");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_io_read_f(void *arg)
+{
+	int fd = *(int *)arg;
+	char buf[16];
+	ssize_t rc = coro_read(fd, buf, sizeof(buf));
+	if (rc != 5 || memcmp(buf, "hello", 5) != 0)
+		return NULL;
+	return arg;
+}
+
+struct test_io_write_ctx {
+	int fd;
+	bool is_done;
+};
+
+static void *
+test_io_write_f(void *arg)
+{
+	struct test_io_write_ctx *ctx = (decltype(ctx))arg;
+	char buf[1024];
+	memset(buf, 'x', sizeof(buf));
+	/* Fill the socket buffer until the write blocks. */
+	while (write(ctx->fd, buf, sizeof(buf)) > 0)
+		;
+	ssize_t rc = coro_write(ctx->fd, buf, sizeof(buf));
+	ctx->is_done = true;
+	return (void *)rc;
+}
+
+static void *
+test_io_accept_f(void *arg)
+{
+	int fd = *(int *)arg;
+	int rc = coro_accept(fd, NULL, NULL);
+	if (rc >= 0)
+		close(rc);
+	return (void *)(rc >= 0);
+}
+
+static void
+test_io(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+		fds) != 0);
+	const uint64_t ms = 1000 * 1000;
+
+	unit_msg("wait with a timeout");
+	unit_check(coro_wait_fd(fds[0], CORO_EVENT_READ, ms) == 0,
+		"timed out");
+	unit_check(coro_wait_fd(fds[0], CORO_EVENT_WRITE, ms) ==
+		CORO_EVENT_WRITE, "ready");
+
+	unit_msg("read waits for the data");
+	struct coro *c = coro_new(test_io_read_f, &fds[0]);
+	coro_sleep(ms);
+	unit_fail_if(write(fds[1], "hello", 5) != 5);
+	unit_check(coro_join(c) == &fds[0], "read");
+
+	unit_msg("write waits for the space");
+	struct test_io_write_ctx wctx;
+	wctx.fd = fds[1];
+	wctx.is_done = false;
+	c = coro_new(test_io_write_f, &wctx);
+	coro_yield();
+	char buf[4096];
+	while (!wctx.is_done) {
+		if (coro_wait_fd(fds[0], CORO_EVENT_READ, ms) > 0)
+			unit_fail_if(read(fds[0], buf, sizeof(buf)) <= 0);
+	}
+	unit_check(coro_join(c) == (void *)1024, "written");
+
+	unit_msg("read and write wait for one descriptor");
+	struct coro *reader = coro_new(test_io_read_f, &fds[1]);
+	coro_yield();
+	wctx.is_done = false;
+	c = coro_new(test_io_write_f, &wctx);
+	coro_yield();
+	while (!wctx.is_done) {
+		if (coro_wait_fd(fds[0], CORO_EVENT_READ, ms) > 0)
+			unit_fail_if(read(fds[0], buf, sizeof(buf)) <= 0);
+	}
+	unit_check(coro_join(c) == (void *)1024, "written");
+	unit_fail_if(write(fds[0], "hello", 5) != 5);
+	unit_check(coro_join(reader) == &fds[1], "read");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_msg("accept waits for a connection");
+	int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	unit_fail_if(lfd < 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	unit_fail_if(bind(lfd, (struct sockaddr *)&addr, addr_len) != 0);
+	unit_fail_if(listen(lfd, 8) != 0);
+	unit_fail_if(getsockname(lfd, (struct sockaddr *)&addr,
+		&addr_len) != 0);
+	c = coro_new(test_io_accept_f, &lfd);
+	coro_yield();
+	int cfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	unit_fail_if(cfd < 0);
+	if (connect(cfd, (struct sockaddr *)&addr, addr_len) != 0) {
+		unit_fail_if(errno != EINPROGRESS);
+		unit_fail_if(coro_wait_fd(cfd, CORO_EVENT_WRITE,
+			UINT64_MAX) != CORO_EVENT_WRITE);
+	}
+	unit_check(coro_join(c) == (void *)true, "accepted");
+	close(cfd);
+	close(lfd);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_prio_ctx {
+	bool is_stopped;
+	long counts[CORO_PRIO_COUNT];
+	long seq;
+};
+
+static void *
+test_prio_yield_f(void *arg)
+{
+	struct test_prio_ctx *ctx = (decltype(ctx))arg;
+	while (!ctx->is_stopped) {
+		++ctx->counts[coro_get_prio(coro_this())];
+		++ctx->seq;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_prio_wait_f(void *arg)
+{
+	struct test_prio_ctx *ctx = (decltype(ctx))arg;
+	coro_suspend();
+	return (void *)ctx->seq;
+}
+
+static void
+test_prio(void)
+{
+	unit_test_start();
+
+	unit_msg("weighted dispatch");
+	struct test_prio_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	struct coro *coros[CORO_PRIO_COUNT * 4];
+	for (int i = 0; i < CORO_PRIO_COUNT * 4; ++i) {
+		coros[i] = coro_new_prio(test_prio_yield_f, &ctx,
+			(enum coro_prio)(i % CORO_PRIO_COUNT));
+	}
+	while (ctx.seq < 21000)
+		coro_yield();
+	ctx.is_stopped = true;
+	for (int i = 0; i < CORO_PRIO_COUNT * 4; ++i)
+		coro_join(coros[i]);
+	long high = ctx.counts[CORO_PRIO_HIGH];
+	long normal = ctx.counts[CORO_PRIO_NORMAL];
+	long background = ctx.counts[CORO_PRIO_BACKGROUND];
+	unit_check(high > 3 * normal, "high is served the most");
+	unit_check(normal > 3 * background, "then normal");
+	unit_check(background > 0, "background is not starved");
+
+	unit_msg("high priority wakeup doesn't wait for the bulk");
+	memset(&ctx, 0, sizeof(ctx));
+	for (int i = 0; i < CORO_PRIO_COUNT * 4; ++i) {
+		coros[i] = coro_new_prio(test_prio_yield_f, &ctx,
+			CORO_PRIO_BACKGROUND);
+	}
+	struct coro *waiter = coro_new_prio(test_prio_wait_f, &ctx,
+		CORO_PRIO_HIGH);
+	coro_yield();
+	long seq = ctx.seq;
+	coro_wakeup(waiter);
+	unit_check((long)coro_join(waiter) <= seq + 1, "woken up first");
+
+	unit_msg("change of the priority");
+	coro_set_prio(coro_this(), CORO_PRIO_BACKGROUND);
+	coro_set_prio(coros[0], CORO_PRIO_HIGH);
+	unit_assert(coro_get_prio(coros[0]) == CORO_PRIO_HIGH);
+	coro_yield();
+	unit_check(ctx.counts[CORO_PRIO_HIGH] > 0, "moved to the new queue");
+	ctx.is_stopped = true;
+	for (int i = 0; i < CORO_PRIO_COUNT * 4; ++i)
+		coro_join(coros[i]);
+	coro_set_prio(coro_this(), CORO_PRIO_NORMAL);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_stats_f(void *arg)
+{
+	uint64_t busy_ns = (uint64_t)arg;
+	for (int i = 0; i < 100; ++i) {
+		uint64_t start = test_clock_ns();
+		while (test_clock_ns() - start < busy_ns)
+			;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	coro_sched_stats_enable(true);
+	coro_sched_trace_start(1024);
+	struct coro *hog = coro_new(test_stats_f, (void *)(1000 * 1000));
+	struct coro *light = coro_new(test_stats_f, (void *)0);
+	coro_yield();
+
+	char *buf;
+	size_t size;
+	FILE *out = open_memstream(&buf, &size);
+	coro_sched_dump(out);
+	fclose(out);
+	char hog_str[64];
+	snprintf(hog_str, sizeof(hog_str), "coro %p: ", (void *)hog);
+	unit_check(strstr(buf, "engine ") != NULL &&
+		strstr(buf, hog_str) != NULL, "dump");
+	free(buf);
+
+	struct coro_stats hog_stats, light_stats;
+	coro_get_stats(hog, &hog_stats);
+	coro_get_stats(light, &light_stats);
+	coro_join(hog);
+	coro_join(light);
+	unit_check(hog_stats.switch_count > 0 &&
+		light_stats.switch_count > 0, "switches are counted");
+	unit_check(hog_stats.run_max_ns >= 1000 * 1000, "hog is seen");
+	unit_check(hog_stats.run_ns > light_stats.run_ns, "run time");
+	unit_check(light_stats.wait_max_ns >= 1000 * 1000,
+		"wait behind the hog");
+
+	out = open_memstream(&buf, &size);
+	unit_fail_if(coro_sched_trace_export(out) != 0);
+	fclose(out);
+	snprintf(hog_str, sizeof(hog_str), "\"name\":\"coro %p\"",
+		(void *)hog);
+	unit_check(strncmp(buf, "{\"traceEvents\":[", 15) == 0 &&
+		strstr(buf, hog_str) != NULL, "trace");
+	free(buf);
+
+	coro_sched_trace_stop();
+	coro_sched_stats_enable(false);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_sync_ctx {
+	struct coro_mutex mutex;
+	struct coro_cond cond;
+	struct coro_sem sem;
+	struct coro_waitgroup wg;
+	/* Protected by the mutex. */
+	long counter;
+	int owner_count;
+	/* Order of the lock owners. */
+	int order[8];
+	int order_count;
+	/* Holders of the semaphore. */
+	int sem_count;
+	int sem_count_max;
+};
+
+struct test_sync_arg {
+	struct test_sync_ctx *ctx;
+	int id;
+};
+
+static void *
+test_sync_lock_f(void *arg)
+{
+	struct test_sync_arg *a = (decltype(a))arg;
+	struct test_sync_ctx *ctx = a->ctx;
+	coro_mutex_lock(&ctx->mutex);
+	ctx->order[ctx->order_count++] = a->id;
+	coro_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static void *
+test_sync_counter_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	bool is_ok = true;
+	for (int i = 0; i < 100; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		is_ok = ++ctx->owner_count == 1 && is_ok;
+		long counter = ctx->counter;
+		coro_yield();
+		ctx->counter = counter + 1;
+		--ctx->owner_count;
+		coro_mutex_unlock(&ctx->mutex);
+		coro_yield();
+	}
+	return (void *)is_ok;
+}
+
+static void *
+test_sync_cond_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	coro_mutex_lock(&ctx->mutex);
+	while (ctx->counter == 0)
+		coro_cond_wait(&ctx->cond, &ctx->mutex);
+	--ctx->counter;
+	coro_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static void *
+test_sync_sem_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	coro_sem_wait(&ctx->sem);
+	if (++ctx->sem_count > ctx->sem_count_max)
+		ctx->sem_count_max = ctx->sem_count;
+	coro_yield();
+	coro_yield();
+	--ctx->sem_count;
+	coro_sem_post(&ctx->sem);
+	return NULL;
+}
+
+static void *
+test_sync_wg_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	++ctx->counter;
+	coro_waitgroup_done(&ctx->wg);
+	return NULL;
+}
+
+static void
+test_sync(void)
+{
+	unit_test_start();
+
+	struct test_sync_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	coro_mutex_create(&ctx.mutex);
+	coro_cond_create(&ctx.cond);
+	coro_sem_create(&ctx.sem, 2);
+	coro_waitgroup_create(&ctx.wg);
+
+	unit_msg("mutex");
+	const int coro_count = 8;
+	struct test_sync_arg args[coro_count];
+	struct coro *coros[coro_count];
+	coro_mutex_lock(&ctx.mutex);
+	unit_check(!coro_mutex_trylock(&ctx.mutex), "trylock of locked");
+	for (int i = 0; i < coro_count; ++i) {
+		args[i].ctx = &ctx;
+		args[i].id = i;
+		coros[i] = coro_new(test_sync_lock_f, &args[i]);
+	}
+	coro_yield();
+	coro_mutex_unlock(&ctx.mutex);
+	/* A newcomer doesn't overtake the waiters. */
+	unit_check(!coro_mutex_trylock(&ctx.mutex), "handed over");
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	bool is_ok = ctx.order_count == coro_count;
+	for (int i = 0; i < ctx.order_count; ++i)
+		is_ok = ctx.order[i] == i && is_ok;
+	unit_check(is_ok, "FIFO");
+	unit_check(coro_mutex_trylock(&ctx.mutex), "trylock of free");
+	coro_mutex_unlock(&ctx.mutex);
+
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_sync_counter_f, &ctx);
+	is_ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		is_ok = coro_join(coros[i]) != NULL && is_ok;
+	unit_check(is_ok && ctx.counter == coro_count * 100, "exclusive");
+
+	unit_msg("condition variable");
+	ctx.counter = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_sync_cond_f, &ctx);
+	coro_yield();
+	coro_mutex_lock(&ctx.mutex);
+	ctx.counter = 1;
+	coro_cond_signal(&ctx.cond);
+	coro_mutex_unlock(&ctx.mutex);
+	coro_join(coros[0]);
+	unit_check(ctx.counter == 0, "signal");
+	coro_mutex_lock(&ctx.mutex);
+	ctx.counter = coro_count - 1;
+	coro_cond_broadcast(&ctx.cond);
+	coro_mutex_unlock(&ctx.mutex);
+	for (int i = 1; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(ctx.counter == 0, "broadcast");
+
+	unit_msg("semaphore");
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_sync_sem_f, &ctx);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(ctx.sem_count_max == 2, "limited");
+	unit_check(coro_sem_trywait(&ctx.sem) && coro_sem_trywait(&ctx.sem) &&
+		!coro_sem_trywait(&ctx.sem), "units are back");
+	coro_sem_post(&ctx.sem);
+	coro_sem_post(&ctx.sem);
+
+	unit_msg("wait group");
+	ctx.counter = 0;
+	coro_waitgroup_wait(&ctx.wg);
+	coro_waitgroup_add(&ctx.wg, coro_count);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_sync_wg_f, &ctx);
+	coro_waitgroup_wait(&ctx.wg);
+	unit_check(ctx.counter == coro_count, "all done");
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+
+	coro_waitgroup_destroy(&ctx.wg);
+	coro_sem_destroy(&ctx.sem);
+	coro_cond_destroy(&ctx.cond);
+	coro_mutex_destroy(&ctx.mutex);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_group_count_f(void *arg)
+{
+	long *counter = (long *)arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	++*counter;
+	return NULL;
+}
+
+static void *
+test_group_sleep_f(void *arg)
+{
+	coro_sleep((uint64_t)arg);
+	return (void *)coro_is_cancelled();
+}
+
+static void *
+test_group_suspend_f(void *arg)
+{
+	(void)arg;
+	coro_suspend();
+	return (void *)coro_is_cancelled();
+}
+
+static void *
+test_group_read_f(void *arg)
+{
+	int fd = *(int *)arg;
+	char c;
+	ssize_t rc = coro_read(fd, &c, 1);
+	return (void *)(rc < 0 && errno == ECANCELED);
+}
+
+static void
+test_group(void)
+{
+	unit_test_start();
+
+	struct coro_group *group = coro_group_new();
+	unit_check(coro_group_wait_any(group) == NULL, "empty");
+
+	unit_msg("join all");
+	const int coro_count = 8;
+	long counter = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coro_group_spawn(group, test_group_count_f, &counter);
+	coro_group_join(group);
+	unit_check(counter == coro_count, "all finished");
+
+	unit_msg("first result, cancel the rest");
+	const uint64_t ms = 1000 * 1000;
+	uint64_t start = test_clock_ns();
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		coros[i] = coro_group_spawn(group, test_group_sleep_f,
+			(void *)((i + 1) * 1000 * ms));
+	}
+	coro_group_spawn(group, test_group_sleep_f, (void *)ms);
+	struct coro *first = coro_group_wait_any(group);
+	unit_check(coro_join(first) == NULL, "first is not cancelled");
+	coro_group_cancel(group);
+	bool is_ok = true;
+	for (int i = 0; i < coro_count; ++i) {
+		unit_assert(coro_group_wait_any(group) == coros[i]);
+		is_ok = coro_join(coros[i]) != NULL && is_ok;
+	}
+	unit_check(is_ok, "others are cancelled");
+	unit_check(test_clock_ns() - start < 500 * ms, "sleeps interrupted");
+	unit_check(coro_group_wait_any(group) == NULL, "empty again");
+
+	unit_msg("cancelled group");
+	coro_group_spawn(group, test_group_sleep_f, (void *)(1000 * ms));
+	struct coro *late = coro_group_spawn(group, test_group_suspend_f,
+		NULL);
+	unit_check(coro_join(coro_group_wait_any(group)) != NULL,
+		"starts cancelled");
+	unit_check(coro_group_wait_any(group) == late &&
+		coro_join(late) != NULL, "suspension interrupted");
+	coro_group_delete(group);
+
+	unit_msg("cancellation of I/O");
+	int fds[2];
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+		fds) != 0);
+	struct coro *reader = coro_new(test_group_read_f, &fds[0]);
+	coro_yield();
+	coro_cancel(reader);
+	unit_check(coro_join(reader) != NULL, "ECANCELED");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_remote_ctx {
+	struct coro_remote remote;
+	uint64_t delay_ns;
+	pthread_t thread;
+	bool is_set;
+};
+
+static void *
+test_remote_thread_f(void *arg)
+{
+	struct test_remote_ctx *ctx = (decltype(ctx))arg;
+	struct timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = ctx->delay_ns;
+	nanosleep(&ts, NULL);
+	__atomic_store_n(&ctx->is_set, true, __ATOMIC_RELAXED);
+	coro_remote_signal(&ctx->remote);
+	return NULL;
+}
+
+static void *
+test_remote_f(void *arg)
+{
+	struct test_remote_ctx *ctx = (decltype(ctx))arg;
+	ctx->is_set = false;
+	coro_remote_start(&ctx->remote);
+	unit_fail_if(pthread_create(&ctx->thread, NULL, test_remote_thread_f,
+		ctx) != 0);
+	/* The wakeup can come before the wait. */
+	if (ctx->delay_ns == 0)
+		coro_sleep(1000 * 1000);
+	coro_remote_wait(&ctx->remote);
+	bool is_set = __atomic_load_n(&ctx->is_set, __ATOMIC_RELAXED);
+	pthread_join(ctx->thread, NULL);
+	return (void *)is_set;
+}
+
+static void *
+test_remote_cancel_f(void *arg)
+{
+	struct coro_remote *remote = (struct coro_remote *)arg;
+	coro_remote_start(remote);
+	coro_remote_cancel(remote);
+	/* Done already, doesn't wait for the inbox. */
+	coro_remote_wait(remote);
+	return arg;
+}
+
+static void
+test_remote(void)
+{
+	unit_test_start();
+
+	const int coro_count = 8;
+	struct test_remote_ctx ctx[coro_count];
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		/* The engine is idle meanwhile, sleeps in the eventfd. */
+		ctx[i].delay_ns = i * 1000 * 1000;
+		coros[i] = coro_new(test_remote_f, &ctx[i]);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		is_ok = coro_join(coros[i]) != NULL && is_ok;
+	unit_check(is_ok, "woken up from other threads");
+
+	unit_msg("a cancelled wakeup is done right away");
+	struct coro_remote remote;
+	struct coro *c = coro_new(test_remote_cancel_f, &remote);
+	unit_check(coro_join(c) == &remote, "not waited");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int test_specific_destroyed = 0;
+
+static void
+test_specific_destroy(void *value)
+{
+	test_specific_destroyed += (int)(intptr_t)value;
+}
+
+static void *
+test_specific_f(void *arg)
+{
+	coro_key_t key = *(coro_key_t *)arg;
+	bool is_ok = coro_getspecific(key) == NULL;
+	coro_setspecific(key, coro_this());
+	for (int i = 0; i < 10; ++i) {
+		coro_yield();
+		is_ok = coro_getspecific(key) == coro_this() && is_ok;
+	}
+	coro_setspecific(key, (void *)1);
+	return (void *)is_ok;
+}
+
+static void *
+test_specific_stale_f(void *arg)
+{
+	coro_key_t *key = (coro_key_t *)arg;
+	coro_setspecific(*key, (void *)1000);
+	coro_suspend();
+	/* The key is deleted and created again meanwhile. */
+	return (void *)(coro_getspecific(*key) == NULL);
+}
+
+static void
+test_specific(void)
+{
+	unit_test_start();
+
+	coro_key_t key;
+	unit_fail_if(coro_key_create(&key, test_specific_destroy) != 0);
+	coro_setspecific(key, (void *)100);
+
+	const int coro_count = 8;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_specific_f, &key);
+	bool is_ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		is_ok = coro_join(coros[i]) != NULL && is_ok;
+	unit_check(is_ok, "values are per coroutine");
+	unit_check(test_specific_destroyed == coro_count, "destroyed on join");
+	unit_check(coro_getspecific(key) == (void *)100, "own value kept");
+
+	/* A reused coroutine starts clean. */
+	struct coro *c = coro_new(test_specific_f, &key);
+	unit_check(coro_join(c) != NULL, "reuse");
+
+	c = coro_new(test_specific_stale_f, &key);
+	coro_yield();
+	coro_key_delete(key);
+	coro_key_t new_key;
+	unit_fail_if(coro_key_create(&new_key, test_specific_destroy) != 0);
+	unit_assert(new_key == key);
+	unit_check(coro_getspecific(key) == NULL, "deleted thread value");
+	int destroyed = test_specific_destroyed;
+	coro_wakeup(c);
+	unit_check(coro_join(c) != NULL, "deleted coroutine value");
+	unit_check(test_specific_destroyed == destroyed,
+		"not destroyed by the new key");
+	coro_key_delete(key);
+
+	coro_key_t keys[CORO_KEY_COUNT];
+	int count = 0;
+	while (count < CORO_KEY_COUNT && coro_key_create(&keys[count],
+							  NULL) == 0)
+		++count;
+	coro_key_t extra;
+	unit_check(count > 0 && coro_key_create(&extra, NULL) != 0,
+		"keys are limited");
+	for (int i = 0; i < count; ++i)
+		coro_key_delete(keys[i]);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -171,9 +1123,378 @@ coro_main_f(void *arg)
 	test_wakup_self();
 	test_join_of_join();
 	test_wakeup_of_finished();
+	test_stack_size();
+	test_pool_trim();
+	test_timers();
+	test_io();
+	test_prio();
+	test_stats();
+	test_sync();
+	test_group();
+	test_remote();
+	test_specific();
 	return NULL;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_workers_ctx {
+	int id;
+	int yield_count;
+	long *counter;
+	/* Ping-pong with a peer coroutine. */
+	struct test_workers_ctx *peer;
+	struct coro *worker;
+	int *turn;
+};
+
+static void *
+test_workers_yield_f(void *arg)
+{
+	struct test_workers_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < ctx->yield_count; ++i) {
+		__atomic_add_fetch(ctx->counter, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_workers_ping_f(void *arg)
+{
+	struct test_workers_ctx *ctx = (decltype(ctx))arg;
+	struct test_workers_ctx *peer;
+	while ((peer = __atomic_load_n(&ctx->peer, __ATOMIC_ACQUIRE)) == NULL)
+		coro_yield();
+	struct coro *peer_coro;
+	while ((peer_coro = __atomic_load_n(&peer->worker,
+					    __ATOMIC_ACQUIRE)) == NULL)
+		coro_yield();
+	for (int i = 0; i < ctx->yield_count; ++i) {
+		while (__atomic_load_n(ctx->turn, __ATOMIC_ACQUIRE) != ctx->id)
+			coro_suspend();
+		__atomic_add_fetch(ctx->counter, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(ctx->turn, peer->id, __ATOMIC_RELEASE);
+		coro_wakeup(peer_coro);
+	}
+	return NULL;
+}
+
+struct test_workers_foreign_ctx {
+	bool is_set;
+	struct coro *waiter;
+};
+
+static void *
+test_workers_foreign_wait_f(void *arg)
+{
+	struct test_workers_foreign_ctx *ctx = (decltype(ctx))arg;
+	while (!__atomic_load_n(&ctx->is_set, __ATOMIC_ACQUIRE))
+		coro_suspend();
+	return arg;
+}
+
+static void *
+test_workers_foreign_thread_f(void *arg)
+{
+	struct test_workers_foreign_ctx *ctx = (decltype(ctx))arg;
+	__atomic_store_n(&ctx->is_set, true, __ATOMIC_RELEASE);
+	coro_wakeup(ctx->waiter);
+	return NULL;
+}
+
+static void *
+test_workers_sleep_f(void *arg)
+{
+	uint64_t timeout = (uint64_t)arg;
+	uint64_t start = test_clock_ns();
+	coro_sleep(timeout);
+	return (void *)(test_clock_ns() - start >= timeout);
+}
+
+static void *
+test_workers_lock_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	bool is_ok = true;
+	for (int i = 0; i < 1000; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		is_ok = __atomic_add_fetch(&ctx->owner_count, 1,
+			__ATOMIC_RELAXED) == 1 && is_ok;
+		++ctx->counter;
+		if (i % 16 == 0)
+			coro_yield();
+		__atomic_sub_fetch(&ctx->owner_count, 1, __ATOMIC_RELAXED);
+		coro_mutex_unlock(&ctx->mutex);
+	}
+	coro_waitgroup_done(&ctx->wg);
+	return (void *)is_ok;
+}
+
+static void *
+test_workers_main_f(void *arg)
+{
+	(void)arg;
+	const int coro_count = 64;
+	const int yield_count = 1000;
+	struct test_workers_ctx ctx[coro_count];
+	int turns[coro_count / 2];
+	long counter = 0;
+
+	unit_msg("yields and ping-pongs in many threads");
+	for (int i = 0; i < coro_count; ++i) {
+		ctx[i].id = i;
+		ctx[i].yield_count = yield_count;
+		ctx[i].counter = &counter;
+		ctx[i].peer = NULL;
+		ctx[i].worker = NULL;
+		ctx[i].turn = &turns[i / 2];
+	}
+	for (int i = 0; i < coro_count; i += 2)
+		turns[i / 2] = i;
+	for (int i = 0; i < coro_count; ++i) {
+		coro_f f = i < coro_count / 2 ? test_workers_yield_f :
+			test_workers_ping_f;
+		__atomic_store_n(&ctx[i].worker, coro_new(f, &ctx[i]),
+			__ATOMIC_RELEASE);
+	}
+	for (int i = coro_count / 2; i < coro_count; i += 2) {
+		__atomic_store_n(&ctx[i].peer, &ctx[i + 1], __ATOMIC_RELEASE);
+		__atomic_store_n(&ctx[i + 1].peer, &ctx[i], __ATOMIC_RELEASE);
+	}
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(ctx[i].worker) == NULL);
+	unit_check(counter == (long)coro_count * yield_count, "all done");
+
+	unit_msg("wakeup from a foreign thread");
+	struct test_workers_foreign_ctx fctx;
+	fctx.is_set = false;
+	fctx.waiter = coro_new(test_workers_foreign_wait_f, &fctx);
+	coro_yield();
+	pthread_t thread;
+	unit_assert(pthread_create(&thread, NULL,
+		test_workers_foreign_thread_f, &fctx) == 0);
+	unit_check(coro_join(fctx.waiter) == &fctx, "woken up");
+	pthread_join(thread, NULL);
+
+	unit_msg("sleeps in many threads");
+	struct coro *sleepers[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		sleepers[i] = coro_new(test_workers_sleep_f,
+			(void *)(uint64_t)(i % 4 * 1000 * 1000));
+	}
+	bool is_ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		is_ok = coro_join(sleepers[i]) != NULL && is_ok;
+	unit_check(is_ok, "slept enough");
+
+	unit_msg("I/O in many threads");
+	int fds[2];
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+		fds) != 0);
+	struct coro *reader = coro_new(test_io_read_f, &fds[0]);
+	coro_sleep(1000 * 1000);
+	unit_fail_if(write(fds[1], "hello", 5) != 5);
+	unit_check(coro_join(reader) == &fds[0], "read");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_msg("mutex and wait group in many threads");
+	struct test_sync_ctx sctx;
+	memset(&sctx, 0, sizeof(sctx));
+	coro_mutex_create(&sctx.mutex);
+	coro_waitgroup_create(&sctx.wg);
+	coro_waitgroup_add(&sctx.wg, coro_count);
+	struct coro *lockers[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		lockers[i] = coro_new(test_workers_lock_f, &sctx);
+	coro_waitgroup_wait(&sctx.wg);
+	unit_check(sctx.counter == (long)coro_count * yield_count,
+		"exclusive");
+	is_ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		is_ok = coro_join(lockers[i]) != NULL && is_ok;
+	unit_check(is_ok, "one owner at a time");
+	coro_waitgroup_destroy(&sctx.wg);
+	coro_mutex_destroy(&sctx.mutex);
+
+	unit_msg("groups in many threads");
+	struct coro_group *group = coro_group_new();
+	counter = 0;
+	for (int i = 0; i < coro_count; ++i) {
+		ctx[i].counter = &counter;
+		coro_group_spawn(group, test_workers_yield_f, &ctx[i]);
+	}
+	coro_group_join(group);
+	unit_check(counter == (long)coro_count * yield_count, "joined all");
+	for (int i = 0; i < coro_count; ++i) {
+		coro_group_spawn(group, test_group_sleep_f,
+			(void *)(uint64_t)(1000 * 1000 * 1000));
+	}
+	coro_yield();
+	coro_group_cancel(group);
+	is_ok = true;
+	struct coro *c;
+	while ((c = coro_group_wait_any(group)) != NULL)
+		is_ok = coro_join(c) != NULL && is_ok;
+	unit_check(is_ok, "cancelled all");
+	coro_group_delete(group);
+
+	unit_msg("remote wakeups in many threads");
+	struct test_remote_ctx rctx[coro_count];
+	struct coro *waiters[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		rctx[i].delay_ns = i % 4 * 1000 * 1000;
+		waiters[i] = coro_new(test_remote_f, &rctx[i]);
+	}
+	is_ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		is_ok = coro_join(waiters[i]) != NULL && is_ok;
+	unit_check(is_ok, "woken up");
+
+	unit_msg("idle workers sleep");
+	struct rusage usage;
+	unit_assert(getrusage(RUSAGE_SELF, &usage) == 0);
+	long switch_count = usage.ru_nvcsw;
+	coro_sleep(100 * 1000 * 1000);
+	unit_assert(getrusage(RUSAGE_SELF, &usage) == 0);
+	unit_check(usage.ru_nvcsw - switch_count < 50, "not polling");
+	return NULL;
+}
+
+static void
+test_workers(void)
+{
+	unit_test_start();
+
+	coro_sched_init_workers(4);
+	struct coro *main_coro = coro_new(test_workers_main_f, NULL);
+	coro_sched_run();
+	unit_check(coro_join(main_coro) == NULL, "main coro rc");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static void *
+test_workers_pool_f(void *arg)
+{
+	(void)arg;
+	const int coro_count = 64;
+	struct test_workers_ctx ctx[coro_count];
+	long counter = 0;
+	for (int round = 0; round < 2; ++round) {
+		for (int i = 0; i < coro_count; ++i) {
+			ctx[i].yield_count = 100;
+			ctx[i].counter = &counter;
+			ctx[i].worker = coro_new(test_workers_yield_f,
+				&ctx[i]);
+		}
+		for (int i = 0; i < coro_count; ++i)
+			unit_assert(coro_join(ctx[i].worker) == NULL);
+	}
+	return (void *)(counter == 2 * coro_count * 100);
+}
+
+static void
+test_workers_pool(void)
+{
+	unit_test_start();
+
+	const int worker_count = 4;
+	coro_sched_init_workers(worker_count);
+	coro_sched_pool_config(1, 2, 16 * 1024);
+	struct coro *main_coro = coro_new(test_workers_pool_f, NULL);
+	coro_sched_run();
+	unit_check(coro_join(main_coro) != NULL, "all done");
+	struct coro_pool_stats stats;
+	coro_sched_pool_stats(&stats);
+	unit_check(stats.idle_count <= 2 * worker_count, "pool is bounded");
+	unit_check(stats.free_count > 0, "freed");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_engines_yield_f(void *arg)
+{
+	long *counter = (long *)arg;
+	for (int i = 0; i < 1000; ++i) {
+		++*counter;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_engines_thread_f(void *arg)
+{
+	(void)arg;
+	if (coro_engine_current() != NULL)
+		return NULL;
+	coro_sched_init();
+	struct coro_engine *engine = coro_engine_current();
+	long counter = 0;
+	struct coro *coros[10];
+	for (int i = 0; i < 10; ++i)
+		coros[i] = coro_new(test_engines_yield_f, &counter);
+	coro_sched_run();
+	for (int i = 0; i < 10; ++i)
+		coro_join(coros[i]);
+	coro_sched_destroy();
+	if (counter != 10 * 1000 || coro_engine_current() != NULL)
+		return NULL;
+	return engine;
+}
+
+static void
+test_engines(void)
+{
+	unit_test_start();
+
+	unit_msg("an engine per thread");
+	const int thread_count = 4;
+	pthread_t threads[thread_count];
+	for (int i = 0; i < thread_count; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL,
+			test_engines_thread_f, NULL) != 0);
+	}
+	void *engines[thread_count];
+	bool is_ok = true;
+	for (int i = 0; i < thread_count; ++i) {
+		pthread_join(threads[i], &engines[i]);
+		is_ok = engines[i] != NULL && is_ok;
+	}
+	unit_check(is_ok, "all threads are done");
+
+	unit_msg("explicit engines");
+	unit_check(coro_engine_current() == NULL, "no engine");
+	struct coro_engine *e1 = coro_engine_new();
+	struct coro_engine *e2 = coro_engine_new();
+	long c1 = 0, c2 = 0;
+	coro_engine_set_current(e1);
+	struct coro *coro1 = coro_new(test_engines_yield_f, &c1);
+	coro_engine_set_current(e2);
+	struct coro *coro2 = coro_new(test_engines_yield_f, &c2);
+	coro_sched_run();
+	unit_check(c1 == 0 && c2 == 1000, "only the current one runs");
+	coro_join(coro2);
+	coro_engine_set_current(e1);
+	coro_sched_run();
+	unit_check(c1 == 1000, "then the other one");
+	coro_join(coro1);
+	coro_engine_set_current(NULL);
+	coro_engine_delete(e1);
+	coro_engine_delete(e2);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 int
 main(void)
 {
@@ -183,5 +1504,9 @@ main(void)
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
 	coro_sched_destroy();
+
+	test_engines();
+	test_workers();
+	test_workers_pool();
 	return 0;
 }
@@ -3,6 +3,7 @@
 #include "unit.h"
 #include "corobus.h"
 
+#include <pthread.h>
 #include <string.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -400,6 +401,45 @@ test_send_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_send_zero_capacity(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 0);
+	unit_assert(c1 >= 0);
+
+	unit_msg("nothing can be sent without a receiver");
+	unit_assert(coro_bus_try_send(bus, c1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("a sender waits for a receiver");
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 1);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(send_join(&send_ctx) == 0);
+
+	unit_msg("a receiver waits for a sender");
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(recv_ctx.is_started && !recv_ctx.is_done);
+	unit_assert(coro_bus_try_send(bus, c1, 2) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0 && data == 2);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_recv_basic(void)
 {
@@ -737,6 +777,22 @@ test_wakeup_on_close(void)
 	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
 	unit_assert(data2 == 654);
 
+	unit_msg("reopen before the waiter runs");
+	c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	coro_yield();
+	unit_assert(recv_ctx1.is_started && !recv_ctx1.is_done);
+	coro_bus_channel_close(bus, c1);
+	int c2 = coro_bus_channel_open(bus, 3);
+	unit_assert(c2 == c1);
+	unit_assert(coro_bus_send(bus, c2, 1) == 0);
+	unit_msg("the waiter doesn't use the new channel");
+	unit_assert(recv_join(&recv_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(data1 == 987);
+	coro_bus_channel_close(bus, c2);
+
 	coro_bus_delete(bus);
 	unit_test_finish();
 }
@@ -1014,6 +1070,173 @@ test_broadcast_blocking_drop_channel_during_wait(void)
 #endif
 }
 
+static void
+test_broadcast_reserve(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+
+	unit_msg("start a broadcast");
+	struct ctx_broadcast ctx;
+	broadcast_start(&ctx, bus, 999);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+
+	unit_msg("freed space is reserved for it");
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_try_send(bus, c1, 2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("a channel filled meanwhile is waited for too");
+	unit_assert(coro_bus_send(bus, c2, 3) == 0);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 3);
+	unit_assert(broadcast_join(&ctx) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 999);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 999);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+static void
+test_broadcast_two_senders(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+
+	unit_msg("two broadcasts wait for the channels in different order");
+	struct ctx_broadcast ctx1, ctx2;
+	broadcast_start(&ctx1, bus, 100);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+	broadcast_start(&ctx2, bus, 200);
+	coro_yield();
+	unit_assert(!ctx1.is_done && !ctx2.is_done);
+
+	unit_msg("a broadcast doesn't sleep holding a slot");
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	/* The first one finds the other channel full and waits there. */
+	coro_yield();
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 2);
+	coro_yield();
+	unit_assert(ctx2.is_done && !ctx1.is_done);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 200);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 200);
+	coro_yield();
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 100);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 100);
+	unit_assert(broadcast_join(&ctx1) == 0);
+	unit_assert(broadcast_join(&ctx2) == 0);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+static void
+test_broadcast_reserve_recv_waits(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	struct ctx_broadcast ctx;
+	broadcast_start(&ctx, bus, 100);
+	coro_yield();
+
+	unit_msg("a receiver waits while the slot is reserved");
+	struct ctx_recv recv_ctx;
+	unsigned recv_data = 0;
+	recv_start(&recv_ctx, bus, c1, &recv_data);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 7);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_try_send(bus, c1, 8) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("the sender doesn't lose its message");
+	unit_assert(broadcast_join(&ctx) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0 && recv_data == 100);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 7);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+static void
+test_broadcast_shared(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_shared(bus, 2);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open_shared(bus, 2);
+	unit_assert(c2 >= 0);
+	int c3 = coro_bus_channel_open(bus, 2);
+	unit_assert(c3 >= 0);
+
+	unit_msg("all the shared channels get the same message");
+	const char text[] = "shared";
+	struct coro_bus_msg *msg = coro_bus_msg_new(text, sizeof(text));
+	unit_assert(coro_bus_broadcast_shared(bus, msg) == 0);
+	unit_assert(coro_bus_try_broadcast_shared(bus, msg) == 0);
+	struct coro_bus_msg *got[2];
+	unit_assert(coro_bus_try_recv_raw(bus, c1, got, sizeof(got[0]),
+		2) == 2);
+	unit_assert(got[0] == msg && got[1] == msg);
+	unit_assert(coro_bus_msg_size(got[0]) == sizeof(text));
+	unit_assert(strcmp((const char *)coro_bus_msg_data(got[0]),
+		text) == 0);
+	coro_bus_msg_unref(got[0]);
+	coro_bus_msg_unref(got[1]);
+
+	unit_msg("the other channels don't");
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, c3, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("full channels block");
+	unit_assert(coro_bus_try_broadcast_shared(bus, msg) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("unreceived references are dropped on close");
+	coro_bus_msg_unref(msg);
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_channel_close(bus, c3);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void
@@ -1604,6 +1827,395 @@ test_recv_vector_blocking_recv_many(void)
 #endif
 }
 
+static void
+test_recv_vector_wakes_senders(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	const unsigned limit = 4;
+	int c1 = coro_bus_channel_open(bus, limit);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 0);
+	unit_assert(c2 >= 0);
+
+	const unsigned coro_count = 3;
+	struct ctx_send ctx[coro_count];
+	unsigned data[limit];
+
+	unit_msg("freed space is given to all the senders it fits");
+	for (unsigned i = 0; i < limit; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	for (unsigned i = 0; i < coro_count; ++i)
+		send_start(&ctx[i], bus, c1, limit + i);
+	coro_yield();
+	unit_assert(coro_bus_recv_v(bus, c1, data, limit) == (int)limit);
+	struct coro_bus_channel_stats stats;
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.depth == coro_count);
+	for (unsigned i = 0; i < coro_count; ++i)
+		unit_assert(send_join(&ctx[i]) == 0);
+	unit_assert(coro_bus_recv_v(bus, c1, data, limit) == (int)coro_count);
+	for (unsigned i = 0; i < coro_count; ++i)
+		unit_assert(data[i] == limit + i);
+
+	unit_msg("a receiver takes from all the waiting senders");
+	for (unsigned i = 0; i < coro_count; ++i)
+		send_start(&ctx[i], bus, c2, i);
+	coro_yield();
+	unit_assert(coro_bus_recv_v(bus, c2, data, limit) == (int)coro_count);
+	for (unsigned i = 0; i < coro_count; ++i) {
+		unit_assert(data[i] == i);
+		unit_assert(send_join(&ctx[i]) == 0);
+	}
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_select {
+	struct coro_bus *bus;
+	struct coro_bus_select_item *items;
+	unsigned count;
+	uint64_t timeout_ns;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+select_f(void *arg)
+{
+	struct ctx_select *ctx = (decltype(ctx))arg;
+	ctx->rc = coro_bus_select(ctx->bus, ctx->items, ctx->count,
+		ctx->timeout_ns);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+select_start(struct ctx_select *ctx, struct coro_bus *bus,
+	struct coro_bus_select_item *items, unsigned count, uint64_t timeout_ns)
+{
+	ctx->bus = bus;
+	ctx->items = items;
+	ctx->count = count;
+	ctx->timeout_ns = timeout_ns;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(select_f, ctx);
+}
+
+static int
+select_join(struct ctx_select *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void
+test_select(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	struct coro_bus_select_item items[2] = {
+		{c1, CORO_BUS_SELECT_RECV, 0},
+		{c2, CORO_BUS_SELECT_RECV, 0},
+	};
+
+	unit_msg("nothing is ready");
+	unit_assert(coro_bus_select(bus, items, 2, 0) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_select(bus, items, 2, 1000000) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("an empty set doesn't wait");
+	unit_assert(coro_bus_select(bus, items, 0, UINT64_MAX) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("wait for any channel");
+	struct ctx_select ctx;
+	select_start(&ctx, bus, items, 2, UINT64_MAX);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+	unit_assert(select_join(&ctx) == 1);
+	unit_assert(items[0].ready == 0);
+	unit_assert(items[1].ready == CORO_BUS_SELECT_RECV);
+
+	unit_msg("the messages are not taken");
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 2);
+
+	unit_msg("wait for space");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	items[0].events = CORO_BUS_SELECT_SEND;
+	unit_assert(coro_bus_select(bus, items, 1, 0) == -1);
+	select_start(&ctx, bus, items, 1, UINT64_MAX);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(select_join(&ctx) == 0);
+	unit_assert(items[0].ready == CORO_BUS_SELECT_SEND);
+
+	unit_msg("a closed channel is ready");
+	items[0].events = CORO_BUS_SELECT_RECV;
+	select_start(&ctx, bus, items, 2, UINT64_MAX);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_channel_close(bus, c2);
+	unit_assert(select_join(&ctx) == 1);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_channel_stats(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	struct coro_bus_channel_stats stats;
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == 0 && stats.recv_count == 0);
+
+	unit_msg("depth");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == 2 && stats.recv_count == 1);
+	unit_assert(stats.depth == 1 && stats.depth_max == 2);
+
+	unit_msg("a sender waits");
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 4);
+	coro_yield();
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_wait_count == 1 && stats.recv_wait_count == 0);
+	unit_assert(stats.wakeup_count == 1);
+	unit_assert(stats.send_count == 4 && stats.depth == 2);
+
+	unit_msg("a receiver waits");
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0 && data == 5);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.recv_wait_count == 1);
+	unit_assert(stats.send_count == 5 && stats.recv_count == 5);
+	unit_assert(stats.depth == 0 && stats.depth_max == 2);
+
+	unit_msg("dump");
+	char *buf;
+	size_t size;
+	FILE *out = open_memstream(&buf, &size);
+	coro_bus_dump(bus, out);
+	fclose(out);
+	unit_assert(strstr(buf, "channels 1") != NULL);
+	unit_assert(strstr(buf, "sent 5, received 5") != NULL);
+	free(buf);
+
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_point {
+	int x;
+	double y;
+};
+
+static void
+test_typed_channel(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	auto c1 = coro_bus_typed_channel<struct test_point>::open(bus, 3);
+	unit_assert(c1.channel >= 0);
+
+	unit_msg("messages are copied whole, across the ring wrap");
+	for (int i = 0; i < 10; ++i) {
+		unit_assert(c1.send({i, i / 2.0}) == 0);
+		unit_assert(c1.send({-i, -i / 2.0}) == 0);
+		struct test_point points[3];
+		unit_assert(c1.recv_v(points, 3) == 2);
+		unit_assert(points[0].x == i && points[0].y == i / 2.0);
+		unit_assert(points[1].x == -i && points[1].y == -i / 2.0);
+	}
+
+	unit_msg("the channel is empty");
+	struct test_point point = {0, 0};
+	unit_assert(c1.try_recv(&point) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("size mismatch");
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, c1.channel, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+	unit_assert(coro_bus_try_send(bus, c1.channel, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+
+#if NEED_BROADCAST
+	unit_msg("broadcast skips the channels of other types");
+	unit_assert(coro_bus_try_broadcast(bus, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_try_broadcast(bus, 1) == 0);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 1);
+	unit_assert(c1.try_recv(&point) != 0);
+	coro_bus_channel_close(bus, c2);
+#endif
+
+	c1.close();
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_MPMC_THREADS = 4,
+	TEST_MPMC_COROS = 4,
+	TEST_MPMC_MSGS = 5000,
+};
+
+struct ctx_mpmc {
+	struct coro_bus_mpmc *mpmc;
+	bool is_sender;
+	/** Sum of the received messages, for all the threads. */
+	unsigned long *sum;
+};
+
+static void *
+mpmc_f(void *arg)
+{
+	struct ctx_mpmc *ctx = (decltype(ctx))arg;
+	unsigned long sum = 0;
+	for (unsigned long i = 1; i <= TEST_MPMC_MSGS; ++i) {
+		if (ctx->is_sender) {
+			if (coro_bus_mpmc_send(ctx->mpmc, &i) != 0)
+				return arg;
+			continue;
+		}
+		unsigned long data;
+		if (coro_bus_mpmc_recv(ctx->mpmc, &data) != 0)
+			return arg;
+		sum += data;
+	}
+	__atomic_add_fetch(ctx->sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *
+mpmc_thread_f(void *arg)
+{
+	coro_sched_init();
+	struct coro *coros[TEST_MPMC_COROS];
+	for (int i = 0; i < TEST_MPMC_COROS; ++i)
+		coros[i] = coro_new(mpmc_f, arg);
+	coro_sched_run();
+	bool is_ok = true;
+	for (int i = 0; i < TEST_MPMC_COROS; ++i)
+		is_ok = coro_join(coros[i]) == NULL && is_ok;
+	coro_sched_destroy();
+	return is_ok ? NULL : arg;
+}
+
+static void *
+mpmc_recv_f(void *arg)
+{
+	struct ctx_mpmc *ctx = (decltype(ctx))arg;
+	return coro_bus_mpmc_recv(ctx->mpmc, ctx->sum) == 0 ? NULL : arg;
+}
+
+static void
+test_mpmc(void)
+{
+	unit_test_start();
+	struct coro_bus_mpmc *mpmc = coro_bus_mpmc_new(3,
+		sizeof(unsigned long));
+
+	unit_msg("capacity is rounded up");
+	unsigned long data = 0;
+	for (unsigned long i = 0; i < 4; ++i)
+		unit_assert(coro_bus_mpmc_try_send(mpmc, &i) == 0);
+	unit_assert(coro_bus_mpmc_try_send(mpmc, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (unsigned long i = 0; i < 4; ++i) {
+		unit_assert(coro_bus_mpmc_try_recv(mpmc, &data) == 0);
+		unit_assert(data == i);
+	}
+	unit_assert(coro_bus_mpmc_try_recv(mpmc, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("a receiver waits in the same thread");
+	unsigned long sum = 0;
+	struct ctx_mpmc ctx = {mpmc, false, &sum};
+	struct coro *c = coro_new(mpmc_recv_f, &ctx);
+	coro_yield();
+	data = 7;
+	unit_assert(coro_bus_mpmc_send(mpmc, &data) == 0);
+	unit_assert(coro_join(c) == NULL && sum == 7);
+
+	unit_msg("senders and receivers in many threads");
+	sum = 0;
+	struct ctx_mpmc senders = {mpmc, true, &sum};
+	struct ctx_mpmc receivers = {mpmc, false, &sum};
+	pthread_t threads[TEST_MPMC_THREADS];
+	for (int i = 0; i < TEST_MPMC_THREADS; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL, mpmc_thread_f,
+			i % 2 == 0 ? &senders : &receivers) != 0);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < TEST_MPMC_THREADS; ++i) {
+		void *rc;
+		pthread_join(threads[i], &rc);
+		is_ok = rc == NULL && is_ok;
+	}
+	unit_check(is_ok, "all threads are done");
+	unsigned long expected = (unsigned long)TEST_MPMC_THREADS / 2 *
+		TEST_MPMC_COROS * TEST_MPMC_MSGS * (TEST_MPMC_MSGS + 1) / 2;
+	unit_check(sum == expected, "all messages are received once");
+	unit_assert(coro_bus_mpmc_try_recv(mpmc, &data) != 0);
+
+	coro_bus_mpmc_delete(mpmc);
+	unit_test_finish();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -1617,6 +2229,7 @@ coro_main_f(void *arg)
 	test_send_basic();
 	test_send_blocking();
 	test_send_blocking_recv_many();
+	test_send_zero_capacity();
 
 	test_recv_basic();
 	test_recv_blocking();
@@ -1630,6 +2243,10 @@ coro_main_f(void *arg)
 	test_broadcast_basic();
 	test_broadcast_blocking_basic();
 	test_broadcast_blocking_drop_channel_during_wait();
+	test_broadcast_reserve();
+	test_broadcast_two_senders();
+	test_broadcast_reserve_recv_waits();
+	test_broadcast_shared();
 
 	test_send_vector_basic();
 	test_send_vector_blocking();
@@ -1638,6 +2255,12 @@ coro_main_f(void *arg)
 	test_recv_vector_basic();
 	test_recv_vector_blocking();
 	test_recv_vector_blocking_recv_many();
+	test_recv_vector_wakes_senders();
+
+	test_typed_channel();
+	test_select();
+	test_channel_stats();
+	test_mpmc();
 	return NULL;
 }
 